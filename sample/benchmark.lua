@@ -0,0 +1,311 @@
+local lwm2m = require 'lwm2m'
+local socket = require 'socket'
+local obj = require 'lwm2mobject'
+local mockserver = require 'mockserver'
+
+-- Get script arguments.
+-- fleetsizes : comma separated numbers of clients (e.g. "1,10,100")
+-- mode : "lua" (clients driven from Lua with luasocket, ll:handle and ll:step)
+--        or "native" (clients bound with ll:bind and driven by fleet:run)
+local args = {...}
+local fleetsizes = args[1] or "1,10,100"
+local iterations = tonumber(args[2] or 1000)
+local serverport = tonumber(args[3] or 5783)
+local firstport = tonumber(args[4] or 6100)
+local mode = args[5] or "lua"
+assert(mode == "lua" or mode == "native", "mode should be lua or native")
+local native = mode == "native"
+local timeout = 2 -- seconds before a request is counted as an error
+
+local serverip = "127.0.0.1"
+local server = mockserver.new(serverport)
+local llfleet -- fleet of the clients in native mode
+
+-- Create a simulated device, each client owns its socket.
+local function newclient(index)
+  local client = {index = index, counter = 0, executed = 0}
+
+  -- Define mandatory objects (used for connection)
+  local securityObj = obj.new(0, {
+    [0]  = "coap://"..serverip..":"..serverport, -- serverURI
+    [1]  = false,                                -- true if it's a bootstrap server
+    [10] = 123,                                  -- short server ID
+    [11] = 0,                                    -- client hold off time (revelant only for bootstrap server)
+  })
+  local serverObj = obj.new(1, {
+    [0]  = 123,                                  -- short server ID
+    [1]  = 86400,                                -- lifetime
+    [7]  = "U",                                  -- binding
+  })
+  local deviceObj = obj.new(3, {
+    [0]  = "Open Mobile Alliance",               -- manufacturer
+    [1]  = "Lightweight M2M Client",             -- model number
+    [2]  = tostring(345000000 + index),          -- serial number
+    [3]  = "1.0",                                -- firmware version
+    [4]  = {execute = function() client.executed = client.executed + 1 end}, -- reboot
+    [13] = {read = function() return client.counter end, type = "number"},  -- observed value
+    [14] = {read = "+01", write = true},         -- utc offset
+    [15] = {read = "Europe/Paris", write = true},-- timezone
+  })
+  deviceObj.native = true -- operations are not changed, compile them in C
+
+  if native then
+    client.ll = lwm2m.init("lua-bench-client-"..index, {securityObj, serverObj, deviceObj},
+      function(serverid) return serverip, serverport end)
+    assert(client.ll:bind(firstport + index))
+    assert(llfleet:add(client.ll))
+    return client
+  end
+  client.udp = socket.udp()
+  assert(client.udp:setsockname(serverip, firstport + index))
+  client.udp:settimeout(0)
+  client.ll = lwm2m.init("lua-bench-client-"..index, {securityObj, serverObj, deviceObj},
+    function(serverid) return serverip, serverport end,
+    function(data, host, port) client.udp:sendto(data, host, port) end)
+  return client
+end
+
+-- handle packets received by clients and by the server,
+-- wait at most wait seconds when there is nothing to do.
+-- In native mode, the fleet loop runs for wait seconds instead
+-- (handling packets and stepping clients in C).
+local function pump(clients, wait)
+  if native then
+    assert(llfleet:run(wait or 0.001))
+    server:receive(0)
+    return
+  end
+  local count = 0
+  for _, client in ipairs(clients) do
+    local data, ip, port = client.udp:receivefrom()
+    while data do
+      client.ll:handle(data, ip, port)
+      count = count + 1
+      data, ip, port = client.udp:receivefrom()
+    end
+  end
+  count = count + server:receive(0)
+  if count == 0 and wait then
+    server:receive(wait)
+  end
+end
+
+-- measure a scenario : run(measure) must call measure(latency, ok) once per
+-- operation. Allocations are measured on the Lua heap only (binding, mock
+-- server and benchmark included) with the garbage collector stopped : C
+-- allocations (malloc of the binding and of liblwm2m) are not counted.
+local function bench(name, nbclients, run)
+  collectgarbage("collect")
+  collectgarbage("stop")
+  local memory = collectgarbage("count")
+  local cpu = os.clock()
+  local start = socket.gettime()
+
+  local latencies = {}
+  local errors = 0
+  run(function (latency, ok)
+    if ok then
+      table.insert(latencies, latency)
+    else
+      errors = errors + 1
+    end
+  end)
+
+  local elapsed = socket.gettime() - start
+  cpu = os.clock() - cpu
+  memory = collectgarbage("count") - memory
+  collectgarbage("restart")
+
+  table.sort(latencies)
+  local ops = #latencies + errors
+  local function percentile(p)
+    if #latencies == 0 then return 0 end
+    return latencies[math.max(1, math.ceil(#latencies * p))] * 1000
+  end
+
+  -- one JSON object by line
+  print(string.format('{"scenario":"%s","mode":"%s","clients":%d,"ops":%d,"errors":%d,'
+    ..'"ops_per_sec":%.1f,"p50_ms":%.3f,"p99_ms":%.3f,'
+    ..'"lua_heap_bytes_per_op":%.1f,"cpu_us_per_op":%.1f}',
+    name, mode, nbclients, ops, errors,
+    elapsed > 0 and ops / elapsed or 0, percentile(0.5), percentile(0.99),
+    ops > 0 and memory * 1024 / ops or 0, ops > 0 and cpu * 1e6 / ops or 0))
+  io.stdout:flush()
+end
+
+-- send iterations requests, each client having at most one pending request.
+local function requests(clients, request)
+  return function (measure)
+    local sent = {} -- {client, sending time} by token
+    local idle = {}
+    for i, client in ipairs(clients) do idle[i] = client end
+    local issued, done = 0, 0
+
+    server.onresponse = function (registration, token, msg)
+      local request = sent[token]
+      if not request then return end
+      measure(socket.gettime() - request[2], msg.code < 0x80)
+      sent[token] = nil
+      done = done + 1
+      table.insert(idle, request[1])
+    end
+
+    while done < iterations and #clients > 0 do
+      while issued < iterations and #idle > 0 do
+        local client = table.remove(idle)
+        local token = server:request(client.registration, request(client))
+        sent[token] = {client, socket.gettime()}
+        issued = issued + 1
+      end
+      pump(clients, 0.001)
+
+      -- count lost requests as errors
+      local now = socket.gettime()
+      for token, request in pairs(sent) do
+        if now - request[2] > timeout then
+          server.pending[token] = nil
+          sent[token] = nil
+          measure(0, false)
+          done = done + 1
+          table.insert(idle, request[1])
+        end
+      end
+    end
+    server.onresponse = nil
+  end
+end
+
+for nbclients in fleetsizes:gmatch("%d+") do
+  nbclients = tonumber(nbclients)
+  if native then llfleet = lwm2m.fleet() end
+  local clients = {}
+  local byport = {}
+  for i = 1, nbclients do
+    local client = newclient(i - 1)
+    clients[i] = client
+    byport[firstport + i - 1] = client
+  end
+
+  -- registration of the whole fleet
+  bench("register", nbclients, function (measure)
+    local registered = 0
+    local start = socket.gettime()
+    server.onregister = function (registration)
+      local client = byport[registration.port]
+      if client and not client.registration then
+        client.registration = registration
+        registration.bench = client
+        registered = registered + 1
+        measure(socket.gettime() - start, true)
+      end
+    end
+    if native then
+      llfleet:start()
+    else
+      for _, client in ipairs(clients) do client.ll:start() end
+    end
+    while registered < nbclients and socket.gettime() - start < timeout * 10 do
+      if not native then
+        for _, client in ipairs(clients) do client.ll:step() end
+      end
+      pump(clients, 0.001)
+    end
+    for _ = registered + 1, nbclients do measure(0, false) end
+    server.onregister = nil
+  end)
+
+  -- registered clients only
+  local fleet = {}
+  for _, client in ipairs(clients) do
+    if client.registration then table.insert(fleet, client) end
+  end
+
+  bench("read-resource", nbclients, requests(fleet, function (client)
+    return mockserver.GET, "/3/0/0"
+  end))
+
+  bench("read-instance", nbclients, requests(fleet, function (client)
+    return mockserver.GET, "/3/0"
+  end))
+
+  local payload = mockserver.tlv({[14] = "+02", [15] = "Europe/Berlin"})
+  bench("write-multi", nbclients, requests(fleet, function (client)
+    return mockserver.PUT, "/3/0", {payload = payload, format = mockserver.TLV}
+  end))
+
+  bench("execute", nbclients, requests(fleet, function (client)
+    return mockserver.POST, "/3/0/4"
+  end))
+
+  -- observe the value of each client, then change it and wait for notifications.
+  bench("observe-notify", nbclients, function (measure)
+    local observing = 0
+    server.onresponse = function (registration, token, msg)
+      registration.bench.observation = token
+      observing = observing + 1
+    end
+    for _, client in ipairs(fleet) do
+      server:request(client.registration, mockserver.GET, "/3/0/13", {observe = true})
+    end
+    local start = socket.gettime()
+    while observing < #fleet and socket.gettime() - start < timeout do
+      pump(fleet, 0.001)
+    end
+    server.onresponse = nil
+
+    local changed = {} -- change time by client
+    local issued, done = 0, 0
+    server.onnotify = function (registration, token, msg)
+      local time = changed[registration.bench]
+      if time then
+        measure(socket.gettime() - time, true)
+        changed[registration.bench] = nil
+        done = done + 1
+      end
+    end
+
+    local observed = {}
+    for _, client in ipairs(fleet) do
+      if client.observation then table.insert(observed, client) end
+    end
+    local index = 1
+    while #observed > 0 and done < iterations do
+      -- change values of clients without pending notification
+      for _ = 1, #observed do
+        local client = observed[index]
+        index = index % #observed + 1
+        if not changed[client] and issued < iterations then
+          issued = issued + 1
+          client.counter = client.counter + 1
+          changed[client] = socket.gettime()
+          client.ll:resourcechanged("/3/0/13")
+          -- (in native mode, the fleet steps changed clients at once)
+          if not native then client.ll:step() end
+        end
+      end
+      pump(observed, 0.001)
+
+      local now = socket.gettime()
+      for client, time in pairs(changed) do
+        if now - time > timeout then
+          changed[client] = nil
+          measure(0, false)
+          done = done + 1
+        end
+      end
+    end
+    server.onnotify = nil
+    for _, client in ipairs(observed) do server:cancel(client.observation) end
+  end)
+
+  -- release the fleet
+  for _, client in ipairs(clients) do
+    client.ll:close()
+    if client.udp then client.udp:close() end
+  end
+  if native then llfleet:close() end
+  clients, byport, fleet, llfleet = nil, nil, nil, nil
+  collectgarbage("collect")
+end
+
+server:close()
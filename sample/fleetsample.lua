@@ -0,0 +1,60 @@
+local lwm2m = require 'lwm2m'
+local obj = require 'lwm2mobject'
+
+-- Get script arguments.
+local args = {...}
+local serverip = args[1] or "127.0.0.1"
+local serverport = args[2] or 5683
+local firstport = tonumber(args[3] or 6000)
+local nbclients = tonumber(args[4] or 100)
+
+-- Create a simulated device.
+local function newclient(index)
+  -- Define mandatory objects (used for connection)
+  local securityObj = obj.new(0, {
+    [0]  = "coap://"..serverport..":"..serverport, -- serverURI
+    [1]  = false,                                  -- true if it's a bootstrap server
+    [10] = 123,                                    -- short server ID
+    [11] = 0,                                      -- client hold off time (revelant only for bootstrap server)
+  })
+  local serverObj = obj.new(1, {
+    [0]  = 123,                                    -- short server ID
+    [1]  = 3600,                                   -- lifetime
+    [7]  = "U",                                    -- binding
+  })
+  local deviceObj = obj.new(3, {
+    [0]  = "Open Mobile Alliance",                 -- manufacturer
+    [1]  = "Lightweight M2M Client",               -- model number
+    [2]  = tostring(345000000 + index),            -- serial number
+    [3]  = "1.0",                                  -- firmware version
+    [13] = {read = function() return os.time() end}, -- current time
+  })
+
+  -- Initialize lwm2m client, each client owns its socket.
+  local ll = lwm2m.init("lua-fleet-client-"..index, {securityObj, serverObj, deviceObj},
+    function(serverid) return serverip,serverport end)
+  assert(ll:bind(firstport + index))
+  return ll
+end
+
+-- Create the fleet.
+local fleet = lwm2m.fleet()
+for i=0,nbclients-1 do
+  local ll = newclient(i)
+  fleet:add(ll)
+end
+
+-- Spread registrations over 10 seconds, and send at most 100 packets by second.
+lwm2m.ratelimit(100)
+fleet:start(10)
+
+-- Communicate ...
+repeat
+  assert(fleet:run(10))
+
+  -- print number of clients by state.
+  local _, counts = fleet:states()
+  for state, count in pairs(counts) do
+    print(state, count)
+  end
+until false
@@ -0,0 +1,307 @@
+-- Minimal LWM2M server stand-in listening on loopback, used by benchmark.lua.
+-- It accepts registrations and sends requests to registered clients,
+-- it is NOT a complete LWM2M server.
+local socket = require 'socket'
+
+local M = {}
+
+-- CoAP constant
+M.CON = 0
+M.NON = 1
+M.ACK = 2
+M.RST = 3
+
+M.GET = 0x01
+M.POST = 0x02
+M.PUT = 0x03
+M.DELETE = 0x04
+
+M.CREATED = 0x41
+M.DELETED = 0x42
+M.CHANGED = 0x44
+M.CONTENT = 0x45
+
+M.OBSERVE = 6
+M.LOCATION_PATH = 8
+M.URI_PATH = 11
+M.CONTENT_FORMAT = 12
+M.URI_QUERY = 15
+
+-- LWM2M content format of TLV payloads
+M.TLV = 1542
+
+-- encode an unsigned integer as a CoAP option value
+local function uint (value)
+  local bytes = ""
+  while value > 0 do
+    bytes = string.char(value % 256) .. bytes
+    value = math.floor(value / 256)
+  end
+  return bytes
+end
+M.uint = uint
+
+-- decode a CoAP option value as an unsigned integer
+local function touint (bytes)
+  local value = 0
+  for i = 1, #bytes do
+    value = value * 256 + bytes:byte(i)
+  end
+  return value
+end
+M.touint = touint
+
+-- encode option delta or length : returns nibble, extended bytes
+local function optionpart (value)
+  if value < 13 then
+    return value, ""
+  elseif value < 269 then
+    return 13, string.char(value - 13)
+  else
+    value = value - 269
+    return 14, string.char(math.floor(value / 256), value % 256)
+  end
+end
+
+-- encode a CoAP message :
+-- {type=, code=, mid=, token=, options={{number, value}, ...}, payload=}
+function M.encode (msg)
+  local token = msg.token or ""
+  local parts = {string.char(64 + msg.type * 16 + #token, msg.code,
+    math.floor(msg.mid / 256), msg.mid % 256), token}
+
+  -- options must be sorted by number (stable for repeated options)
+  local options = {}
+  for i, option in ipairs(msg.options or {}) do
+    options[i] = {option[1], option[2], i}
+  end
+  table.sort(options, function (a, b)
+    return a[1] < b[1] or (a[1] == b[1] and a[3] < b[3])
+  end)
+
+  local last = 0
+  for _, option in ipairs(options) do
+    local delta, deltaext = optionpart(option[1] - last)
+    local length, lengthext = optionpart(#option[2])
+    table.insert(parts, string.char(delta * 16 + length) .. deltaext .. lengthext .. option[2])
+    last = option[1]
+  end
+
+  if msg.payload and #msg.payload > 0 then
+    table.insert(parts, "\255" .. msg.payload)
+  end
+  return table.concat(parts)
+end
+
+-- read extended option delta or length : returns value, next position
+local function readpart (data, nibble, pos)
+  if nibble == 13 then
+    return data:byte(pos) + 13, pos + 1
+  elseif nibble == 14 then
+    return data:byte(pos) * 256 + data:byte(pos + 1) + 269, pos + 2
+  end
+  return nibble, pos
+end
+
+-- decode a CoAP message, returns nil if it is malformed
+function M.decode (data)
+  if #data < 4 then return nil end
+  local b0 = data:byte(1)
+  local tkl = b0 % 16
+  local msg = {
+    type = math.floor(b0 / 16) % 4,
+    code = data:byte(2),
+    mid = data:byte(3) * 256 + data:byte(4),
+    token = data:sub(5, 4 + tkl),
+    options = {},
+  }
+
+  local pos = 5 + tkl
+  local number = 0
+  while pos <= #data do
+    local b = data:byte(pos)
+    if b == 0xFF then
+      msg.payload = data:sub(pos + 1)
+      break
+    end
+    local delta, length
+    delta, pos = readpart(data, math.floor(b / 16), pos + 1)
+    length, pos = readpart(data, b % 16, pos)
+    if not delta or not length then return nil end
+    number = number + delta
+    table.insert(msg.options, {number, data:sub(pos, pos + length - 1)})
+    pos = pos + length
+  end
+  return msg
+end
+
+-- get all values of the given option
+function M.option (msg, number)
+  local values = {}
+  for _, option in ipairs(msg.options) do
+    if option[1] == number then table.insert(values, option[2]) end
+  end
+  return values
+end
+
+-- encode resources {[id] = string value, ...} as a TLV payload
+function M.tlv (resources)
+  local parts = {}
+  for id, value in pairs(resources) do
+    value = tostring(value)
+    -- resource with value, 8 bits identifier
+    if #value < 8 then
+      table.insert(parts, string.char(0xC0 + #value, id) .. value)
+    else
+      table.insert(parts, string.char(0xC8, id, #value) .. value)
+    end
+  end
+  return table.concat(parts)
+end
+
+-- server methods
+local S = {}
+S.__index = S
+
+-- send a CoAP message to the given address
+function S:send (msg, ip, port)
+  self.udp:sendto(M.encode(msg), ip, port)
+end
+
+-- send a confirmable request to a registered client,
+-- returns the token used to match the response or the notifications.
+-- options : {payload=, format=, observe=true}
+function S:request (client, method, path, options)
+  options = options or {}
+  self.mid = (self.mid + 1) % 65536
+  self.token = self.token + 1
+  local token = uint(self.token)
+
+  local msg = {type = M.CON, code = method, mid = self.mid, token = token,
+    options = {}, payload = options.payload}
+  if options.observe then
+    table.insert(msg.options, {M.OBSERVE, ""})
+  end
+  for segment in path:gmatch("[^/]+") do
+    table.insert(msg.options, {M.URI_PATH, segment})
+  end
+  if options.format then
+    table.insert(msg.options, {M.CONTENT_FORMAT, uint(options.format)})
+  end
+
+  if options.observe then
+    self.observations[token] = client
+  end
+  self.pending[token] = client
+  self:send(msg, client.ip, client.port)
+  return token
+end
+
+-- stop matching notifications of the given observation
+function S:cancel (token)
+  self.observations[token] = nil
+end
+
+-- handle a message received from a client
+function S:handle (data, ip, port)
+  local msg = M.decode(data)
+  if not msg then return end
+  local address = ip .. ":" .. port
+
+  -- response to a request of the server
+  if self.pending[msg.token] and msg.type ~= M.CON then
+    local client = self.pending[msg.token]
+    self.pending[msg.token] = nil
+    if self.onresponse then self.onresponse(client, msg.token, msg) end
+    return
+  end
+
+  -- notification of an observed resource
+  if self.observations[msg.token] and msg.code >= 0x40 then
+    if msg.type == M.CON then
+      self:send({type = M.ACK, code = 0, mid = msg.mid}, ip, port)
+    end
+    if self.onnotify then self.onnotify(self.observations[msg.token], msg.token, msg) end
+    return
+  end
+
+  -- registration interface
+  local path = M.option(msg, M.URI_PATH)
+  if msg.type ~= M.CON or path[1] ~= "rd" then
+    if msg.type == M.CON then
+      self:send({type = M.RST, code = 0, mid = msg.mid}, ip, port)
+    end
+    return
+  end
+
+  local response = {type = M.ACK, mid = msg.mid, token = msg.token, options = {}}
+  if msg.code == M.POST and not path[2] then
+    -- register
+    local endpoint
+    for _, query in ipairs(M.option(msg, M.URI_QUERY)) do
+      endpoint = query:match("^ep=(.*)") or endpoint
+    end
+    self.location = self.location + 1
+    local client = {ip = ip, port = port, endpoint = endpoint,
+      location = tostring(self.location), links = msg.payload}
+    self.clients[address] = client
+    self.locations[client.location] = client
+    response.code = M.CREATED
+    table.insert(response.options, {M.LOCATION_PATH, "rd"})
+    table.insert(response.options, {M.LOCATION_PATH, client.location})
+    self:send(response, ip, port)
+    if self.onregister then self.onregister(client) end
+  elseif msg.code == M.POST and self.locations[path[2]] then
+    -- update
+    response.code = M.CHANGED
+    self:send(response, ip, port)
+  elseif msg.code == M.DELETE and self.locations[path[2]] then
+    -- deregister
+    local client = self.locations[path[2]]
+    self.locations[path[2]] = nil
+    self.clients[client.ip .. ":" .. client.port] = nil
+    response.code = M.DELETED
+    self:send(response, ip, port)
+    if self.onderegister then self.onderegister(client) end
+  else
+    response.code = 0x84 -- not found
+    self:send(response, ip, port)
+  end
+end
+
+-- handle all packets received within timeout seconds,
+-- returns the number of handled packets.
+function S:receive (timeout)
+  local count = 0
+  self.udp:settimeout(timeout or 0)
+  local data, ip, port = self.udp:receivefrom()
+  while data do
+    self:handle(data, ip, port)
+    count = count + 1
+    self.udp:settimeout(0)
+    data, ip, port = self.udp:receivefrom()
+  end
+  return count
+end
+
+function S:close ()
+  self.udp:close()
+end
+
+-- create a server listening on the loopback interface
+function M.new (port)
+  local udp = socket.udp()
+  assert(udp:setsockname("127.0.0.1", port or 5683))
+  return setmetatable({
+    udp = udp,
+    mid = 0,
+    token = 0,
+    location = 0,
+    clients = {},      -- registered clients by "ip:port"
+    locations = {},    -- registered clients by location
+    pending = {},      -- clients by token of pending requests
+    observations = {}, -- clients by token of observations
+  }, S)
+end
+
+return M
@@ -0,0 +1,46 @@
+local lwm2m = require 'lwm2m'
+local obj = require 'lwm2mobject'
+
+-- Get script arguments.
+local args = {...}
+local serverip = args[1] or "127.0.0.1"
+local serverport = args[2] or 5683
+local deviceport = args[3] or 5682
+
+-- Define mandatory objects (used for connection)
+local securityObj = obj.new(0, {
+  [0]  = "coap://"..serverport..":"..serverport,   -- serverURI
+  [1]  = false,                                    -- true if it's a bootstrap server
+  [10] = 123,                                      -- short server ID
+  [11] = 0,                                        -- client hold off time (revelant only for bootstrap server)
+})
+local serverObj = obj.new(1, {
+  [0]  = 123,                                      -- short server ID
+  [1]  = 3600,                                        -- lifetime
+  [7]  = "U",                                      -- binding
+})
+local deviceObj = obj.new(3, {
+  [0]  = "Open Mobile Alliance",                   -- manufacturer
+  [1]  = "Lightweight M2M Client",                 -- model number
+  [2]  = "345000123",                              -- serial number
+  [3]  = "1.0",                                    -- firmware version
+  [13] = {                                         -- current time
+    read  = function() return os.time() end,
+    write = function (i,v) print(v) end,
+    type  = "date"},
+})
+
+-- Initialize lwm2m client.
+-- (no send callback : packets are sent on the socket owned by the binding)
+local ll = lwm2m.init("lua-nativeloop-client", {securityObj,serverObj,deviceObj},
+  function(serverid) return serverip,serverport end)
+
+-- Let the binding own the UDP socket.
+assert(ll:bind(deviceport))
+
+-- Communicate ...
+ll:start()
+repeat
+  -- run the native loop, coming back to Lua every 5 seconds.
+  assert(ll:run(5))
+until false
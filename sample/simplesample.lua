@@ -43,7 +43,8 @@ local ll = lwm2m.init("lua-client", {securityObj,serverObj,deviceObj},
 -- Communicate ...
 ll:start()
 repeat
-  ll:step()
+  -- step returns the number of seconds before the next needed step.
+  udp:settimeout(ll:step())
   local data, ip, port, msg = udp:receivefrom()
   if data then
     ll:handle(data,ip,port)
@@ -0,0 +1,24 @@
+local lwm2m = require 'lwm2m'
+local socket = require 'socket'
+
+-- Get script arguments.
+local args = {...}
+local serverip = args[1] or "127.0.0.1"
+local serverport = args[2] or 5683
+local firstport = tonumber(args[3] or 6000)
+local nbclients = tonumber(args[4] or 1000)
+local nbthreads = tonumber(args[5] or 4)
+
+-- Create shards : each one runs workersshard.lua in its own lua_State.
+-- (more shards than threads lets idle threads take work from busy ones)
+local workers = lwm2m.workers("workersshard.lua", nbthreads * 4, nbthreads,
+  serverip, serverport, firstport, nbclients)
+
+-- Communicate ...
+workers:start()
+repeat
+  socket.sleep(10)
+  for i, shard in ipairs(workers:stats()) do
+    print(i, shard.clients, shard.iterations, shard.error or "")
+  end
+until false
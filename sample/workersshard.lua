@@ -0,0 +1,45 @@
+-- Script run by each shard of workerssample.lua, in its own lua_State.
+-- It must return a fleet.
+local lwm2m = require 'lwm2m'
+local obj = require 'lwm2mobject'
+
+-- Get script arguments.
+local shard, nbshards, serverip, serverport, firstport, nbclients = ...
+
+-- Create a simulated device.
+local function newclient(index)
+  -- Define mandatory objects (used for connection)
+  local securityObj = obj.new(0, {
+    [0]  = "coap://"..serverport..":"..serverport, -- serverURI
+    [1]  = false,                                  -- true if it's a bootstrap server
+    [10] = 123,                                    -- short server ID
+    [11] = 0,                                      -- client hold off time (revelant only for bootstrap server)
+  })
+  local serverObj = obj.new(1, {
+    [0]  = 123,                                    -- short server ID
+    [1]  = 3600,                                   -- lifetime
+    [7]  = "U",                                    -- binding
+  })
+  local deviceObj = obj.new(3, {
+    [0]  = "Open Mobile Alliance",                 -- manufacturer
+    [1]  = "Lightweight M2M Client",               -- model number
+    [2]  = tostring(345000000 + index),            -- serial number
+    [3]  = "1.0",                                  -- firmware version
+    [13] = {read = function() return os.time() end}, -- current time
+  })
+
+  local ll = lwm2m.init("lua-workers-client-"..index, {securityObj, serverObj, deviceObj},
+    function(serverid) return serverip,serverport end)
+  assert(ll:bind(firstport + index))
+  return ll
+end
+
+-- Create clients of this shard (client i goes to shard i % nbshards).
+local fleet = lwm2m.fleet()
+for i=shard-1,nbclients-1,nbshards do
+  local ll = newclient(i)
+  fleet:add(ll)
+  ll:start()
+end
+
+return fleet
@@ -0,0 +1,195 @@
+/*
+ MIT License (MIT)
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ */
+
+// Buffers give Lua a view on packets owned by the binding, without copying
+// them in Lua strings :
+// - a buffer is only valid during the callback it is given to, data must be
+//   copied with tostring(buffer) or buffer:sub(i,j) to be kept,
+// - buffers are recycled : each context keeps a pool of buffer userdata.
+
+#include "lua5.1/lua.h"
+#include "lua5.1/lauxlib.h"
+#include "lua5.1/lualib.h"
+
+#include "lua_liblwm2m.h"
+#include <string.h>
+
+static llwm_buffer * checkbuffer(lua_State * L, const char * functionname) {
+	llwm_buffer * buf = (llwm_buffer *) luaL_checkudata(L, 1,
+			"lualwm2m.buffer");
+
+	if (buf->data == NULL)
+		luaL_error(L,
+				"bad argument #1 to '%s' (buffer is no more valid, copy it with tostring during the callback)",
+				functionname);
+
+	return buf;
+}
+
+// Push the given data on the stack : in a buffer from the pool if the context
+// uses buffers, else in a string.
+void llwm_buffer_push(llwm_userdata * lwu, const uint8_t * data, size_t length) {
+	lua_State * L = lwu->L;
+	if (!lwu->useBuffers) {
+		lua_pushlstring(L, (const char *) data, length);
+		return;
+	}
+
+	// Get the pool (created at first use).
+	if (lwu->bufferPoolRef == LUA_NOREF) {
+		lua_newtable(L); // stack: ..., pool
+		lwu->bufferPoolRef = luaL_ref(L, LUA_REGISTRYINDEX); // stack: ...
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, lwu->bufferPoolRef); // stack: ..., pool
+
+	// Get a free buffer, or create it.
+	lwu->buffersUsed++;
+	lua_rawgeti(L, -1, lwu->buffersUsed); // stack: ..., pool, buffer
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1); // stack: ..., pool
+		lua_newuserdata(L, sizeof(llwm_buffer)); // stack: ..., pool, buffer
+		luaL_getmetatable(L, "lualwm2m.buffer"); // stack: ..., pool, buffer, metatable
+		lua_setmetatable(L, -2); // stack: ..., pool, buffer
+		lua_pushvalue(L, -1); // stack: ..., pool, buffer, buffer
+		lua_rawseti(L, -3, lwu->buffersUsed); // stack: ..., pool, buffer
+	}
+	llwm_buffer * buf = (llwm_buffer *) lua_touserdata(L, -1);
+	buf->data = data;
+	buf->length = length;
+	lua_remove(L, -2); // stack: ..., buffer
+}
+
+// Give back the buffers pushed after the first used ones to the pool, they are
+// no more valid for Lua (a callback can re-enter the context : buffers of outer
+// callbacks stay valid).
+void llwm_buffer_release(llwm_userdata * lwu, int used) {
+	if (lwu->buffersUsed <= used)
+		return;
+
+	lua_State * L = lwu->L;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, lwu->bufferPoolRef); // stack: ..., pool
+	int i;
+	for (i = used + 1; i <= lwu->buffersUsed; i++) {
+		lua_rawgeti(L, -1, i); // stack: ..., pool, buffer
+		llwm_buffer * buf = (llwm_buffer *) lua_touserdata(L, -1);
+		buf->data = NULL;
+		buf->length = 0;
+		lua_pop(L, 1); // stack: ..., pool
+	}
+	lua_pop(L, 1); // stack: ...
+	lwu->buffersUsed = used;
+}
+
+// Get data at the given index of the stack : a valid buffer or a string.
+// return NULL if it is neither a string nor a valid buffer.
+const uint8_t * llwm_todata(lua_State * L, int index, size_t * lengthP) {
+	if (lua_type(L, index) == LUA_TUSERDATA) {
+		if (!lua_getmetatable(L, index))
+			return NULL;
+		luaL_getmetatable(L, "lualwm2m.buffer");
+		int isBuffer = lua_rawequal(L, -1, -2);
+		lua_pop(L, 2);
+		if (!isBuffer)
+			return NULL;
+		llwm_buffer * buf = (llwm_buffer *) lua_touserdata(L, index);
+		*lengthP = buf->length;
+		return buf->data;
+	}
+	if (lua_type(L, index) != LUA_TSTRING)
+		return NULL;
+	return (const uint8_t *) lua_tolstring(L, index, lengthP);
+}
+
+static int buffer_len(lua_State *L) {
+	llwm_buffer * buf = checkbuffer(L, "len");
+	lua_pushinteger(L, buf->length);
+	return 1;
+}
+
+static int buffer_tostring(lua_State *L) {
+	llwm_buffer * buf = checkbuffer(L, "tostring");
+	lua_pushlstring(L, (const char *) buf->data, buf->length);
+	return 1;
+}
+
+// Same as string.sub : buffer:sub(i [, j]) with negative indexes from the end.
+static int buffer_sub(lua_State *L) {
+	llwm_buffer * buf = checkbuffer(L, "sub");
+	long length = buf->length;
+	long start = luaL_checklong(L, 2);
+	long end = luaL_optlong(L, 3, -1);
+	if (start < 0)
+		start += length + 1;
+	if (end < 0)
+		end += length + 1;
+	if (start < 1)
+		start = 1;
+	if (end > length)
+		end = length;
+	if (start > end)
+		lua_pushliteral(L, "");
+	else
+		lua_pushlstring(L, (const char *) buf->data + start - 1, end - start + 1);
+	return 1;
+}
+
+// Same as string.byte : buffer:byte([i [, j]])
+static int buffer_byte(lua_State *L) {
+	llwm_buffer * buf = checkbuffer(L, "byte");
+	long length = buf->length;
+	long start = luaL_optlong(L, 2, 1);
+	long end = luaL_optlong(L, 3, start);
+	if (start < 0)
+		start += length + 1;
+	if (end < 0)
+		end += length + 1;
+	if (start < 1)
+		start = 1;
+	if (end > length)
+		end = length;
+	if (start > end)
+		return 0;
+	int n = end - start + 1;
+	luaL_checkstack(L, n, "buffer slice too long");
+	long i;
+	for (i = start; i <= end; i++)
+		lua_pushinteger(L, buf->data[i - 1]);
+	return n;
+}
+
+static const struct luaL_Reg buffer_objmeths[] = { { "len", buffer_len }, {
+		"tostring", buffer_tostring }, { "sub", buffer_sub }, { "byte",
+		buffer_byte }, { "__len", buffer_len }, { "__tostring",
+		buffer_tostring }, { NULL, NULL } };
+
+void llwm_buffer_register(lua_State * L) {
+	// Define buffer object metatable.
+	luaL_newmetatable(L, "lualwm2m.buffer"); // stack: metatable
+
+	// Do : metatable.__index = metatable.
+	lua_pushvalue(L, -1); // stack: metatable, metatable
+	lua_setfield(L, -2, "__index"); // stack: metatable
+
+	// Register buffer object methods : set methods to table on top of the stack
+	luaL_register(L, NULL, buffer_objmeths); // stack: metatable
+	lua_pop(L, 1); // stack:
+}
@@ -0,0 +1,446 @@
+/*
+ MIT License (MIT)
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ */
+
+// A fleet runs many lwm2m contexts in one loop :
+// - inbound packets are dispatched to the right context by the local socket
+//   they are received on (one epoll instance for all contexts),
+// - contexts are kept in a min-heap ordered by their next step time, so
+//   lwm2m_step is only called for contexts whose deadline has passed.
+
+#include "lua5.1/lua.h"
+#include "lua5.1/lauxlib.h"
+#include "lua5.1/lualib.h"
+
+#include "lua_liblwm2m.h"
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+static llwm_fleet * checkfleet(lua_State * L, const char * functionname) {
+	llwm_fleet * fleet = (llwm_fleet *) luaL_checkudata(L, 1,
+			"lualwm2m.fleet");
+
+	if (fleet->epollfd < 0)
+		luaL_error(L, "bad argument #1 to '%s' (fleet object is closed)",
+				functionname);
+
+	return fleet;
+}
+
+static void prv_heap_swap(llwm_fleet * fleet, int i, int j) {
+	llwm_userdata * tmp = fleet->members[i];
+	fleet->members[i] = fleet->members[j];
+	fleet->members[j] = tmp;
+	fleet->members[i]->fleetIndex = i;
+	fleet->members[j]->fleetIndex = j;
+}
+
+static void prv_heap_up(llwm_fleet * fleet, int i) {
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (fleet->members[parent]->nextStep <= fleet->members[i]->nextStep)
+			return;
+		prv_heap_swap(fleet, i, parent);
+		i = parent;
+	}
+}
+
+static void prv_heap_down(llwm_fleet * fleet, int i) {
+	while (1) {
+		int smallest = i;
+		int left = 2 * i + 1;
+		int right = left + 1;
+		if (left < fleet->count
+				&& fleet->members[left]->nextStep
+						< fleet->members[smallest]->nextStep)
+			smallest = left;
+		if (right < fleet->count
+				&& fleet->members[right]->nextStep
+						< fleet->members[smallest]->nextStep)
+			smallest = right;
+		if (smallest == i)
+			return;
+		prv_heap_swap(fleet, i, smallest);
+		i = smallest;
+	}
+}
+
+// Update position of the context in the step scheduler after its nextStep changed.
+void llwm_fleet_reschedule(llwm_userdata * lwu) {
+	llwm_fleet * fleet = lwu->fleet;
+	prv_heap_up(fleet, lwu->fleetIndex);
+	prv_heap_down(fleet, lwu->fleetIndex);
+}
+
+// Remove the context from its fleet.
+void llwm_fleet_remove(llwm_userdata * lwu) {
+	llwm_fleet * fleet = lwu->fleet;
+
+	// Replace it by the last context of the heap.
+	int i = lwu->fleetIndex;
+	fleet->count--;
+	if (i != fleet->count) {
+		fleet->members[i] = fleet->members[fleet->count];
+		fleet->members[i]->fleetIndex = i;
+		prv_heap_up(fleet, i);
+		prv_heap_down(fleet, fleet->members[i]->fleetIndex);
+	}
+
+	// Stop listening its socket.
+	if (lwu->sock >= 0)
+		epoll_ctl(fleet->epollfd, EPOLL_CTL_DEL, lwu->sock, NULL);
+
+	// Release reference on the context.
+	luaL_unref(lwu->L, LUA_REGISTRYINDEX, lwu->fleetRef);
+	lwu->fleetRef = LUA_NOREF;
+	lwu->fleetIndex = -1;
+	lwu->fleet = NULL;
+}
+
+int llwm_fleet_new(lua_State * L) {
+	// Create fleet userdata object and set its metatable.
+	llwm_fleet * fleet = lua_newuserdata(L, sizeof(llwm_fleet)); // stack: fleet
+	fleet->running = 0;
+	fleet->members = NULL;
+	fleet->count = 0;
+	fleet->capacity = 0;
+	fleet->epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (fleet->epollfd < 0)
+		return luaL_error(L, "unable to create fleet : %s", strerror(errno));
+	luaL_getmetatable(L, "lualwm2m.fleet"); // stack: fleet, metatable
+	lua_setmetatable(L, -2); // stack: fleet
+
+	return 1;
+}
+
+static int fleet_add(lua_State * L) {
+	// Get fleet and llwm userdata.
+	llwm_fleet * fleet = checkfleet(L, "add");
+	llwm_userdata * lwu = llwm_checkudata(L, 2, "add");
+	if (lwu->sock < 0)
+		return luaL_error(L,
+				"bad argument #2 to 'add' (no socket bound, call 'bind' first)");
+	if (lwu->fleet != NULL)
+		return luaL_error(L, "bad argument #2 to 'add' (already in a fleet)");
+
+	// Grow heap if needed.
+	if (fleet->count == fleet->capacity) {
+		int capacity = fleet->capacity == 0 ? 64 : fleet->capacity * 2;
+		llwm_userdata ** members = realloc(fleet->members,
+				capacity * sizeof(llwm_userdata *));
+		if (members == NULL)
+			return luaL_error(L, "Memory allocation problem when 'add'");
+		fleet->members = members;
+		fleet->capacity = capacity;
+	}
+
+	// Listen its socket.
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = lwu;
+	if (epoll_ctl(fleet->epollfd, EPOLL_CTL_ADD, lwu->sock, &ev) < 0) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+
+	// Keep a reference on the context while it is in the fleet.
+	lua_pushvalue(L, 2); // stack: fleet, llwm, llwm
+	lwu->fleetRef = luaL_ref(L, LUA_REGISTRYINDEX); // stack: fleet, llwm
+
+	// Add it to the step scheduler.
+	lwu->fleet = fleet;
+	lwu->fleetIndex = fleet->count;
+	fleet->members[fleet->count] = lwu;
+	fleet->count++;
+	prv_heap_up(fleet, lwu->fleetIndex);
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int fleet_remove(lua_State * L) {
+	// Get fleet and llwm userdata.
+	llwm_fleet * fleet = checkfleet(L, "remove");
+	llwm_userdata * lwu = llwm_checkudata(L, 2, "remove");
+	if (lwu->fleet != fleet)
+		return luaL_error(L, "bad argument #2 to 'remove' (not in this fleet)");
+
+	llwm_fleet_remove(lwu);
+	return 0;
+}
+
+// Get the monotonic time (in ms) of the next due step of the fleet.
+int64_t llwm_fleet_next_step(llwm_fleet * fleet) {
+	if (fleet->count > 0)
+		return fleet->members[0]->nextStep;
+	return llwm_monotonic_time_ms() + (int64_t) LLWM_MAX_STEP_TIMEOUT * 1000;
+}
+
+// Do one iteration of the fleet loop : step all due contexts, then wait at most
+// waitms milliseconds for packets (less if a step is due before) and dispatch them.
+// return 0 if ok or an errno value.
+int llwm_fleet_poll(llwm_fleet * fleet, int64_t waitms) {
+	// Step all due contexts (each one at most once per iteration).
+	int64_t now = llwm_monotonic_time_ms();
+	int budget = fleet->count;
+	while (budget-- > 0 && fleet->count > 0
+			&& fleet->members[0]->nextStep <= now) {
+		llwm_userdata * lwu = fleet->members[0];
+		lua_State * L = lwu->L;
+		int top = lua_gettop(L);
+		int64_t timeout;
+		int res = llwm_dostep(lwu, &timeout);
+		// (callbacks may leave values on the stack)
+		lua_settop(L, top);
+		if (res != 0 && lwu->fleet == fleet) {
+			// retry later rather than spinning on a failing context.
+			lwu->nextStep = now + 1000;
+			llwm_fleet_reschedule(lwu);
+		}
+	}
+	if (fleet->epollfd < 0)
+		return 0;
+
+	// Do not wait after the next due step.
+	now = llwm_monotonic_time_ms();
+	int64_t next = llwm_fleet_next_step(fleet);
+	int64_t stepms = next > now ? next - now : 0;
+	if (stepms < waitms)
+		waitms = stepms;
+
+	struct epoll_event events[LLWM_MAX_EVENTS];
+	int n = epoll_wait(fleet->epollfd, events, LLWM_MAX_EVENTS, waitms);
+	if (n < 0)
+		return errno == EINTR ? 0 : errno;
+
+	// Dispatch packets to the context owning the socket.
+	int i;
+	for (i = 0; i < n; i++) {
+		llwm_userdata * lwu = (llwm_userdata *) events[i].data.ptr;
+		// (events without context are used to wake up the fleet)
+		if (lwu != NULL && lwu->fleet == fleet) {
+			lua_State * L = lwu->L;
+			int top = lua_gettop(L);
+			llwm_receive(lwu);
+			lua_settop(L, top);
+		}
+	}
+	return 0;
+}
+
+// Loop of fleet_run (called in protected mode).
+static int prv_run_loop(lua_State * L) {
+	// Get fleet userdata.
+	llwm_fleet * fleet = checkfleet(L, "run");
+
+	// Get duration in seconds (optional, run until 'stop' if nil).
+	int hasDeadline = !lua_isnoneornil(L, 2);
+	int64_t deadline = llwm_monotonic_time_ms()
+			+ (int64_t) (luaL_optnumber(L, 2, 0) * 1000);
+
+	while (fleet->running && fleet->epollfd >= 0) {
+		int64_t waitms = (int64_t) LLWM_MAX_STEP_TIMEOUT * 1000;
+		if (hasDeadline) {
+			int64_t remaining = deadline - llwm_monotonic_time_ms();
+			if (remaining <= 0)
+				break;
+			if (remaining < waitms)
+				waitms = remaining;
+		}
+
+		int err = llwm_fleet_poll(fleet, waitms);
+		if (err != 0) {
+			lua_pushnil(L);
+			lua_pushstring(L, strerror(err));
+			return 2;
+		}
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int fleet_run(lua_State * L) {
+	// Get fleet userdata.
+	llwm_fleet * fleet = checkfleet(L, "run");
+
+	// Run the loop in protected mode : an error raised by a callback stops
+	// the loop cleanly before it is raised again.
+	lua_settop(L, 2); // stack: fleet, duration
+	lua_pushcfunction(L, prv_run_loop); // stack: fleet, duration, loop
+	lua_insert(L, 1); // stack: loop, fleet, duration
+	fleet->running = 1;
+	int res = lua_pcall(L, 2, LUA_MULTRET, 0);
+	fleet->running = 0;
+	if (res != 0) {
+		int i;
+		for (i = 0; i < fleet->count; i++)
+			llwm_buffer_release(fleet->members[i], 0);
+		return lua_error(L);
+	}
+	return lua_gettop(L);
+}
+
+static int fleet_stop(lua_State * L) {
+	// Get fleet userdata.
+	llwm_fleet * fleet = checkfleet(L, "stop");
+
+	// Fleet loop will return after the current iteration.
+	fleet->running = 0;
+	return 0;
+}
+
+static int fleet_states(lua_State * L) {
+	// Get fleet userdata.
+	llwm_fleet * fleet = checkfleet(L, "states");
+
+	// Push a list of {client, state, nextstep} and a count of clients by state.
+	int64_t now = llwm_monotonic_time_ms();
+	lua_createtable(L, fleet->count, 0); // stack: fleet, list
+	lua_newtable(L); // stack: fleet, list, counts
+	int i;
+	for (i = 0; i < fleet->count; i++) {
+		llwm_userdata * lwu = fleet->members[i];
+		const char * state = llwm_state(lwu);
+
+		lua_createtable(L, 0, 3); // stack: fleet, list, counts, entry
+		lua_rawgeti(L, LUA_REGISTRYINDEX, lwu->fleetRef);
+		lua_setfield(L, -2, "client");
+		lua_pushstring(L, state);
+		lua_setfield(L, -2, "state");
+		lua_pushnumber(L,
+				lwu->nextStep > now ? (lwu->nextStep - now) / 1000.0 : 0);
+		lua_setfield(L, -2, "nextstep");
+		lua_rawseti(L, -3, i + 1); // stack: fleet, list, counts
+
+		lua_getfield(L, -1, state); // stack: fleet, list, counts, count
+		lua_Integer count = lua_tointeger(L, -1);
+		lua_pop(L, 1); // stack: fleet, list, counts
+		lua_pushinteger(L, count + 1);
+		lua_setfield(L, -2, state);
+	}
+
+	return 2;
+}
+
+static int fleet_start(lua_State * L) {
+	// Get fleet userdata.
+	llwm_fleet * fleet = checkfleet(L, "start");
+
+	// Get jitter in seconds (optional) : starts are spread over it.
+	double jitter = luaL_optnumber(L, 2, 0);
+
+	// Get seed of the jitter (optional) : by default, it differs for each
+	// process and each call, so restarted processes do not stagger the same way.
+	uint64_t seed;
+	if (lua_isnoneornil(L, 3))
+		seed = (uint64_t) time(NULL) ^ (uint64_t) getpid() << 16
+				^ (uint64_t) llwm_monotonic_time_us();
+	else
+		seed = (uint64_t) luaL_checknumber(L, 3);
+	unsigned short xsubi[3] = { seed, seed >> 16, seed >> 32 };
+
+	// Scheduling a start reorders the heap : iterate on a copy (a userdata, so
+	// it is collected if a start raises an error).
+	int count = fleet->count;
+	llwm_userdata ** members = lua_newuserdata(L,
+			(count + 1) * sizeof(llwm_userdata *)); // stack: fleet, [jitter, [seed]], members
+	memcpy(members, fleet->members, count * sizeof(llwm_userdata *));
+
+	// Each client starts at a random time in its own slot of the jitter window,
+	// so starts are paced evenly.
+	int i;
+	for (i = 0; i < count; i++) {
+		double delay = 0;
+		if (jitter > 0)
+			delay = jitter * (i + erand48(xsubi)) / count;
+		llwm_schedule_start(members[i], delay);
+	}
+	return 0;
+}
+
+static int fleet_stats(lua_State * L) {
+	// Get fleet userdata.
+	llwm_fleet * fleet = checkfleet(L, "stats");
+	int reset = lua_toboolean(L, 2);
+
+	// Push statistics of all contexts, reset them if asked.
+	llwm_stats * stats = malloc(sizeof(llwm_stats));
+	if (stats == NULL)
+		return luaL_error(L, "stats: memory allocation error");
+	memset(stats, 0, sizeof(llwm_stats));
+	int i;
+	for (i = 0; i < fleet->count; i++) {
+		llwm_stats_merge(stats, &fleet->members[i]->stats);
+		if (reset)
+			memset(&fleet->members[i]->stats, 0, sizeof(llwm_stats));
+	}
+	llwm_stats_push(L, stats);
+	free(stats);
+	return 1;
+}
+
+static int fleet_close(lua_State * L) {
+	// Get fleet userdata.
+	llwm_fleet * fleet = (llwm_fleet *) luaL_checkudata(L, 1,
+			"lualwm2m.fleet");
+
+	// Release all contexts.
+	while (fleet->count > 0)
+		llwm_fleet_remove(fleet->members[fleet->count - 1]);
+	free(fleet->members);
+	fleet->members = NULL;
+	fleet->capacity = 0;
+
+	// Release epoll instance.
+	if (fleet->epollfd >= 0) {
+		close(fleet->epollfd);
+		fleet->epollfd = -1;
+	}
+	fleet->running = 0;
+
+	return 0;
+}
+
+static const struct luaL_Reg fleet_objmeths[] = { { "add", fleet_add }, {
+		"remove", fleet_remove }, { "run", fleet_run }, { "stop", fleet_stop }, {
+		"states", fleet_states }, { "start", fleet_start }, { "stats",
+		fleet_stats }, { "close", fleet_close }, { "__gc", fleet_close }, {
+		NULL, NULL } };
+
+void llwm_fleet_register(lua_State * L) {
+	// Define fleet object metatable.
+	luaL_newmetatable(L, "lualwm2m.fleet"); // stack: metatable
+
+	// Do : metatable.__index = metatable.
+	lua_pushvalue(L, -1); // stack: metatable, metatable
+	lua_setfield(L, -2, "__index"); // stack: metatable
+
+	// Register fleet object methods : set methods to table on top of the stack
+	luaL_register(L, NULL, fleet_objmeths); // stack: metatable
+	lua_pop(L, 1); // stack:
+}
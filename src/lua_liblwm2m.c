@@ -20,15 +20,27 @@
  THE SOFTWARE.
  */
 
+#define _GNU_SOURCE // sendmmsg
+
 #include "lua5.1/lua.h"
 #include "lua5.1/lauxlib.h"
 #include "lua5.1/lualib.h"
 
-#include "liblwm2m.h"
+#include "lua_liblwm2m.h"
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
 
-extern lwm2m_object_t * get_lua_object(lua_State *L, int tableindex, int objId);
+// Send rate limiter shared by all contexts (of all workers threads).
+static llwm_bucket globalBucket;
+static pthread_mutex_t globalBucketLock = PTHREAD_MUTEX_INITIALIZER;
 
 void stackdump_g(lua_State* l) {
 	int i;
@@ -57,20 +69,178 @@ void stackdump_g(lua_State* l) {
 	printf("\n"); /* end the listing */
 }
 
-typedef struct llwm_addr_t {
-	char * host;
-	int port;
-} llwm_addr_t;
+// Get current time in seconds from a monotonic clock.
+time_t llwm_monotonic_time() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
 
-typedef struct llwm_userdata {
-	lua_State * L;
-	lwm2m_context_t * ctx;
-	int sendCallbackRef;
-	int connectServerCallbackRef;
-} llwm_userdata;
+// Get current time in milliseconds from a monotonic clock.
+int64_t llwm_monotonic_time_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-static llwm_userdata * checkllwm(lua_State * L, const char * functionname) {
-	llwm_userdata* lwu = (llwm_userdata*) luaL_checkudata(L, 1,
+// Get current time in microseconds from a monotonic clock.
+int64_t llwm_monotonic_time_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Resolve host and port of the given address in its sockaddr.
+static void prv_resolve_addr(llwm_addr_t * la) {
+	la->addrLen = 0;
+
+	char port[8];
+	snprintf(port, sizeof(port), "%d", la->port);
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	struct addrinfo * res = NULL;
+	if (getaddrinfo(la->host, port, &hints, &res) != 0 || res == NULL)
+		return;
+	memcpy(&la->addr, res->ai_addr, res->ai_addrlen);
+	la->addrLen = res->ai_addrlen;
+	freeaddrinfo(res);
+}
+
+// Compare 2 socket addresses (family, ip and port).
+static int prv_addr_equals(const struct sockaddr * a, const struct sockaddr * b) {
+	if (a->sa_family != b->sa_family)
+		return 0;
+	if (a->sa_family == AF_INET) {
+		const struct sockaddr_in * a4 = (const struct sockaddr_in *) a;
+		const struct sockaddr_in * b4 = (const struct sockaddr_in *) b;
+		return a4->sin_port == b4->sin_port
+				&& a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+	} else if (a->sa_family == AF_INET6) {
+		const struct sockaddr_in6 * a6 = (const struct sockaddr_in6 *) a;
+		const struct sockaddr_in6 * b6 = (const struct sockaddr_in6 *) b;
+		return a6->sin6_port == b6->sin6_port
+				&& memcmp(&a6->sin6_addr, &b6->sin6_addr,
+						sizeof(struct in6_addr)) == 0;
+	}
+	return 0;
+}
+
+// Hash a socket address (ip and port).
+static uint32_t prv_addr_hash(const struct sockaddr * addr) {
+	const uint8_t * bytes;
+	size_t len;
+	uint16_t port;
+	if (addr->sa_family == AF_INET) {
+		const struct sockaddr_in * a4 = (const struct sockaddr_in *) addr;
+		bytes = (const uint8_t *) &a4->sin_addr;
+		len = sizeof(struct in_addr);
+		port = a4->sin_port;
+	} else if (addr->sa_family == AF_INET6) {
+		const struct sockaddr_in6 * a6 = (const struct sockaddr_in6 *) addr;
+		bytes = (const uint8_t *) &a6->sin6_addr;
+		len = sizeof(struct in6_addr);
+		port = a6->sin6_port;
+	} else {
+		return 0;
+	}
+
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	size_t i;
+	for (i = 0; i < len; i++)
+		hash = (hash ^ bytes[i]) * 16777619u;
+	hash = (hash ^ (port & 0xFF)) * 16777619u;
+	hash = (hash ^ (port >> 8)) * 16777619u;
+	return hash;
+}
+
+// Parse a numeric host and a port in a socket address.
+// return 1 if ok or 0 if host is not a numeric ip.
+static int prv_parse_addr(const char * host, int port,
+		struct sockaddr_storage * addr) {
+	memset(addr, 0, sizeof(struct sockaddr_storage));
+	struct sockaddr_in * a4 = (struct sockaddr_in *) addr;
+	if (inet_pton(AF_INET, host, &a4->sin_addr) == 1) {
+		a4->sin_family = AF_INET;
+		a4->sin_port = htons(port);
+		return 1;
+	}
+	struct sockaddr_in6 * a6 = (struct sockaddr_in6 *) addr;
+	if (inet_pton(AF_INET6, host, &a6->sin6_addr) == 1) {
+		a6->sin6_family = AF_INET6;
+		a6->sin6_port = htons(port);
+		return 1;
+	}
+	return 0;
+}
+
+// Add a session in the session hash table.
+static void prv_add_session(llwm_userdata * lwu, llwm_addr_t * la) {
+	// unresolved sessions can not be found by address, keep them in bucket 0.
+	la->hash = la->addrLen > 0 ? prv_addr_hash((struct sockaddr *) &la->addr) : 0;
+	// insert at head : the most recent session for an address wins.
+	uint32_t bucket = la->hash & (LLWM_SESSION_BUCKETS - 1);
+	la->next = lwu->sessions[bucket];
+	lwu->sessions[bucket] = la;
+}
+
+// Find the session of the server with the given socket address.
+static llwm_addr_t * prv_find_session_by_addr(llwm_userdata * lwu,
+		const struct sockaddr * addr) {
+	uint32_t hash = prv_addr_hash(addr);
+	llwm_addr_t * session = lwu->sessions[hash & (LLWM_SESSION_BUCKETS - 1)];
+	while (session != NULL) {
+		if (session->hash == hash && session->addrLen > 0
+				&& prv_addr_equals((struct sockaddr *) &session->addr, addr))
+			return session;
+		session = session->next;
+	}
+	return NULL;
+}
+
+// Find the session of the server with the given host and port.
+static llwm_addr_t * prv_find_session(llwm_userdata * lwu, const char * host,
+		int port) {
+	// Numeric ip (e.g. from luasocket receivefrom) : use the hash table.
+	struct sockaddr_storage addr;
+	if (prv_parse_addr(host, port, &addr))
+		return prv_find_session_by_addr(lwu, (struct sockaddr *) &addr);
+
+	// Else compare with the host given by the connect server callback.
+	int i;
+	for (i = 0; i < LLWM_SESSION_BUCKETS; i++) {
+		llwm_addr_t * session = lwu->sessions[i];
+		while (session != NULL) {
+			if (session->port == port && strcmp(session->host, host) == 0)
+				return session;
+			session = session->next;
+		}
+	}
+	return NULL;
+}
+
+// Release all sessions of the session hash table.
+static void prv_free_sessions(llwm_userdata * lwu) {
+	int i;
+	for (i = 0; i < LLWM_SESSION_BUCKETS; i++) {
+		llwm_addr_t * session = lwu->sessions[i];
+		while (session != NULL) {
+			llwm_addr_t * next = session->next;
+			free(session->host);
+			free(session);
+			session = next;
+		}
+		lwu->sessions[i] = NULL;
+	}
+}
+
+llwm_userdata * llwm_checkudata(lua_State * L, int index,
+		const char * functionname) {
+	llwm_userdata* lwu = (llwm_userdata*) luaL_checkudata(L, index,
 			"lualwm2m.llwm");
 
 	if (lwu->ctx == NULL)
@@ -80,22 +250,362 @@ static llwm_userdata * checkllwm(lua_State * L, const char * functionname) {
 	return lwu;
 }
 
-static uint8_t prv_buffer_send_callback(void * sessionH, uint8_t * buffer,
-		size_t length, void * userData) {
+static llwm_userdata * checkllwm(lua_State * L, const char * functionname) {
+	return llwm_checkudata(L, 1, functionname);
+}
 
-	llwm_userdata * ud = userData;
+// Set the monotonic time (in ms) at which the next lwm2m_step is needed.
+static void prv_set_next_step(llwm_userdata * lwu, int64_t nextStep) {
+	lwu->nextStep = nextStep;
+	if (lwu->fleet != NULL)
+		llwm_fleet_reschedule(lwu);
+}
+
+// Queue a packet in the send buffer of the context.
+// return 0 if ok or -1 if memory allocation failed.
+static int prv_queue_packet(llwm_userdata * lwu, llwm_addr_t * la,
+		uint8_t * buffer, size_t length) {
+	// Grow packet list if needed.
+	if (lwu->sendCount == lwu->sendCapacity) {
+		int capacity = lwu->sendCapacity == 0 ? 16 : lwu->sendCapacity * 2;
+		llwm_packet * queue = realloc(lwu->sendQueue,
+				capacity * sizeof(llwm_packet));
+		if (queue == NULL)
+			return -1;
+		lwu->sendQueue = queue;
+		lwu->sendCapacity = capacity;
+	}
+
+	// Grow data buffer if needed.
+	if (lwu->sendBufferLength + length > lwu->sendBufferCapacity) {
+		size_t capacity = lwu->sendBufferCapacity == 0 ?
+				LLWM_MAX_PACKET_SIZE : lwu->sendBufferCapacity;
+		while (capacity < lwu->sendBufferLength + length)
+			capacity *= 2;
+		uint8_t * data = realloc(lwu->sendBuffer, capacity);
+		if (data == NULL)
+			return -1;
+		lwu->sendBuffer = data;
+		lwu->sendBufferCapacity = capacity;
+	}
+
+	// Copy packet.
+	llwm_packet * packet = &lwu->sendQueue[lwu->sendCount++];
+	packet->session = la;
+	packet->offset = lwu->sendBufferLength;
+	packet->length = length;
+	memcpy(lwu->sendBuffer + lwu->sendBufferLength, buffer, length);
+	lwu->sendBufferLength += length;
+	return 0;
+}
+
+// Send all queued packets on the socket owned by the binding.
+static void prv_flush_socket(llwm_userdata * lwu) {
+	struct mmsghdr msgs[LLWM_MAX_BATCH];
+	struct iovec iovecs[LLWM_MAX_BATCH];
+
+	int sent = 0;
+	while (sent < lwu->sendCount) {
+		// Prepare the next batch (unresolved sessions are skipped).
+		int n = 0;
+		int next = sent;
+		while (next < lwu->sendCount && n < LLWM_MAX_BATCH) {
+			llwm_packet * packet = &lwu->sendQueue[next++];
+			if (packet->session->addrLen == 0)
+				continue;
+			iovecs[n].iov_base = lwu->sendBuffer + packet->offset;
+			iovecs[n].iov_len = packet->length;
+			memset(&msgs[n], 0, sizeof(struct mmsghdr));
+			msgs[n].msg_hdr.msg_name = &packet->session->addr;
+			msgs[n].msg_hdr.msg_namelen = packet->session->addrLen;
+			msgs[n].msg_hdr.msg_iov = &iovecs[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+			n++;
+		}
+
+		// Send it, packets which can not be sent are dropped (as with sendto).
+		int done = 0;
+		while (done < n) {
+			int res = sendmmsg(lwu->sock, msgs + done, n - done, 0);
+			if (res <= 0) {
+				if (res < 0 && errno == EINTR)
+					continue;
+				lwu->stats.sendErrors++;
+				done++; // drop the packet in error and go on.
+			} else {
+				done += res;
+			}
+		}
+		sent = next;
+	}
+}
+
+// Call the function on the stack with nargs arguments in protected mode, then
+// release the buffers given to it, used being the number of buffers used before
+// they were pushed (even if it failed : they point into packets which are freed
+// once sent).
+// return 0 if ok, or the error code with the error message on the stack.
+static int prv_call_send(llwm_userdata * lwu, int nargs, int used) {
+	int res = lua_pcall(lwu->L, nargs, 0, 0);
+	llwm_buffer_release(lwu, used);
+	return res;
+}
+
+// Send all queued packets through the Lua callbacks.
+static void prv_flush_lua(llwm_userdata * lwu) {
+	lua_State * L = lwu->L;
+	int i;
+
+	// Without batch callback, call the send callback for each packet.
+	if (lwu->batchCallbackRef == LUA_NOREF
+			|| lwu->batchCallbackRef == LUA_REFNIL) {
+		if (lwu->sendCallbackRef == LUA_REFNIL)
+			return;
+		for (i = 0; i < lwu->sendCount; i++) {
+			llwm_packet * packet = &lwu->sendQueue[i];
+			int used = lwu->buffersUsed;
+			lua_rawgeti(L, LUA_REGISTRYINDEX, lwu->sendCallbackRef);
+			llwm_buffer_push(lwu, lwu->sendBuffer + packet->offset,
+					packet->length);
+			lua_pushstring(L, packet->session->host);
+			lua_pushnumber(L, packet->session->port);
+			if (prv_call_send(lwu, 3, used) != 0) {
+				// while closing, errors are only counted.
+				if (lwu->closing) {
+					lua_pop(L, 1);
+					lwu->stats.sendErrors++;
+					continue;
+				}
+				// forget the queue, then raise the error.
+				lwu->sendCount = 0;
+				lwu->sendBufferLength = 0;
+				lua_error(L);
+			}
+		}
+		return;
+	}
+
+	// Call the batch callback once with the list of {data, host, port}.
+	int used = lwu->buffersUsed;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, lwu->batchCallbackRef); // stack: ..., batchFunc
+	lua_createtable(L, lwu->sendCount, 0); // stack: ..., batchFunc, packets
+	for (i = 0; i < lwu->sendCount; i++) {
+		llwm_packet * packet = &lwu->sendQueue[i];
+		lua_createtable(L, 3, 0); // stack: ..., batchFunc, packets, packet
+		llwm_buffer_push(lwu, lwu->sendBuffer + packet->offset,
+				packet->length);
+		lua_rawseti(L, -2, 1);
+		lua_pushstring(L, packet->session->host);
+		lua_rawseti(L, -2, 2);
+		lua_pushnumber(L, packet->session->port);
+		lua_rawseti(L, -2, 3);
+		lua_rawseti(L, -2, i + 1); // stack: ..., batchFunc, packets
+	}
+	if (prv_call_send(lwu, 1, used) != 0) { // stack: ..., error
+		// while closing, errors are only counted.
+		if (lwu->closing) {
+			lua_pop(L, 1);
+			lwu->stats.sendErrors++;
+			return;
+		}
+		// forget the queue, then raise the error.
+		lwu->sendCount = 0;
+		lwu->sendBufferLength = 0;
+		lua_error(L);
+	}
+}
+
+// Send all packets queued since the last flush.
+void llwm_flush(llwm_userdata * lwu) {
+	if (lwu->sendCount == 0)
+		return;
+
+	if (lwu->sock >= 0)
+		prv_flush_socket(lwu);
+	else
+		prv_flush_lua(lwu);
+
+	lwu->sendCount = 0;
+	lwu->sendBufferLength = 0;
+}
+
+// Configure a token bucket with rate tokens by second (0 : no limit) and
+// at most burst tokens, the bucket starts full.
+static void prv_set_bucket(llwm_bucket * bucket, double rate, double burst) {
+	if (rate < 0)
+		rate = 0;
+	if (burst < 1)
+		burst = rate > 1 ? rate : 1;
+	bucket->rate = rate;
+	bucket->burst = burst;
+	bucket->tokens = burst;
+	bucket->last = llwm_monotonic_time_ms();
+}
+
+// Add the tokens earned since the last refill.
+static void prv_refill_bucket(llwm_bucket * bucket, int64_t now) {
+	bucket->tokens += (now - bucket->last) * bucket->rate / 1000;
+	if (bucket->tokens > bucket->burst)
+		bucket->tokens = bucket->burst;
+	bucket->last = now;
+}
+
+// Take a send token in the bucket of the context and in the global one.
+// return 1 if a packet can be sent now, 0 if it must wait.
+static int prv_take_token(llwm_userdata * lwu) {
+	int64_t now = llwm_monotonic_time_ms();
+	llwm_bucket * bucket = &lwu->bucket;
+	if (bucket->rate > 0) {
+		prv_refill_bucket(bucket, now);
+		if (bucket->tokens < 1)
+			return 0;
+	}
+
+	int ok = 1;
+	pthread_mutex_lock(&globalBucketLock);
+	if (globalBucket.rate > 0) {
+		prv_refill_bucket(&globalBucket, now);
+		if (globalBucket.tokens < 1)
+			ok = 0;
+		else
+			globalBucket.tokens -= 1;
+	}
+	pthread_mutex_unlock(&globalBucketLock);
+
+	if (ok && bucket->rate > 0)
+		bucket->tokens -= 1;
+	return ok;
+}
+
+// Send a packet now (or queue it in batch mode).
+static uint8_t prv_send_packet(llwm_userdata * ud, llwm_addr_t * la,
+		uint8_t * buffer, size_t length) {
 	lua_State * L = ud->L;
-	llwm_addr_t * la = (llwm_addr_t *) sessionH;
+	llwm_stats_sent(&ud->stats, buffer, length);
+	// Sent notifications and registration messages change the saved state.
+	ud->storeDirty = 1;
+
+	// In batch mode, packets are only queued.
+	if (ud->batchSend) {
+		if (prv_queue_packet(ud, la, buffer, length) != 0) {
+			ud->stats.sendErrors++;
+			return COAP_500_INTERNAL_SERVER_ERROR ;
+		}
+		return COAP_NO_ERROR ;
+	}
+
+	// Send directly on the socket owned by the binding.
+	if (ud->sock >= 0) {
+		if (la->addrLen == 0 || sendto(ud->sock, buffer, length, 0,
+				(struct sockaddr *) &la->addr, la->addrLen) < 0) {
+			ud->stats.sendErrors++;
+			return COAP_500_INTERNAL_SERVER_ERROR ;
+		}
+		return COAP_NO_ERROR ;
+	}
 
+	// Else send through the Lua callback.
+	if (ud->sendCallbackRef == LUA_REFNIL) {
+		ud->stats.sendErrors++;
+		return COAP_500_INTERNAL_SERVER_ERROR ;
+	}
+	int used = ud->buffersUsed;
 	lua_rawgeti(L, LUA_REGISTRYINDEX, ud->sendCallbackRef);
-	lua_pushlstring(L, buffer, length);
+	llwm_buffer_push(ud, buffer, length);
 	lua_pushstring(L, la->host);
 	lua_pushnumber(L, la->port);
-	lua_call(L, 3, 0);
+	if (prv_call_send(ud, 3, used) != 0) {
+		// while closing, errors are only counted.
+		if (!ud->closing)
+			lua_error(L);
+		lua_pop(L, 1);
+		ud->stats.sendErrors++;
+		return COAP_500_INTERNAL_SERVER_ERROR ;
+	}
 
 	return COAP_NO_ERROR ;
 }
 
+// Hold back a packet until send tokens are available. A confirmable message
+// which is already waiting is not queued twice (wakaama retransmits it meanwhile).
+static uint8_t prv_pace_packet(llwm_userdata * lwu, llwm_addr_t * la,
+		uint8_t * buffer, size_t length) {
+	if (length >= 4 && ((buffer[0] >> 4) & 0x03) == 0) {
+		llwm_paced * paced;
+		for (paced = lwu->pacedHead; paced != NULL; paced = paced->next) {
+			if (paced->session == la && paced->length >= 4
+					&& ((paced->data[0] >> 4) & 0x03) == 0
+					&& paced->data[2] == buffer[2] && paced->data[3] == buffer[3])
+				return COAP_NO_ERROR ;
+		}
+	}
+
+	llwm_paced * paced = malloc(sizeof(llwm_paced) + length);
+	if (paced == NULL) {
+		lwu->stats.sendErrors++;
+		return COAP_500_INTERNAL_SERVER_ERROR ;
+	}
+	paced->next = NULL;
+	paced->session = la;
+	paced->length = length;
+	memcpy(paced->data, buffer, length);
+	if (lwu->pacedTail != NULL)
+		lwu->pacedTail->next = paced;
+	else
+		lwu->pacedHead = paced;
+	lwu->pacedTail = paced;
+	lwu->stats.paced++;
+	return COAP_NO_ERROR ;
+}
+
+// Get the time (in ms) before a send token is available in the given bucket.
+static int64_t prv_bucket_wait(llwm_bucket * bucket, int64_t now) {
+	if (bucket->rate <= 0)
+		return 0;
+	prv_refill_bucket(bucket, now);
+	if (bucket->tokens >= 1)
+		return 0;
+	return (int64_t) ((1 - bucket->tokens) * 1000 / bucket->rate) + 1;
+}
+
+// Get the time (in ms) before the next held back packet can be sent.
+static int64_t prv_paced_wait(llwm_userdata * lwu) {
+	int64_t now = llwm_monotonic_time_ms();
+	int64_t wait = prv_bucket_wait(&lwu->bucket, now);
+	pthread_mutex_lock(&globalBucketLock);
+	int64_t globalWait = prv_bucket_wait(&globalBucket, now);
+	pthread_mutex_unlock(&globalBucketLock);
+	return globalWait > wait ? globalWait : wait;
+}
+
+// Send the held back packets while send tokens are available (all of them if force).
+static void prv_drain_paced(llwm_userdata * lwu, int force) {
+	while (lwu->pacedHead != NULL && (force || prv_take_token(lwu))) {
+		llwm_paced * paced = lwu->pacedHead;
+		lwu->pacedHead = paced->next;
+		if (lwu->pacedHead == NULL)
+			lwu->pacedTail = NULL;
+		prv_send_packet(lwu, paced->session, paced->data, paced->length);
+		free(paced);
+	}
+}
+
+static uint8_t prv_buffer_send_callback(void * sessionH, uint8_t * buffer,
+		size_t length, void * userData) {
+
+	llwm_userdata * ud = userData;
+	llwm_addr_t * la = (llwm_addr_t *) sessionH;
+
+	// Registrations resumed from the store are not sent again.
+	if (llwm_store_mutes(ud, la))
+		return COAP_NO_ERROR ;
+
+	// Over the send rate, packets wait (in order) for the next steps.
+	if (ud->pacedHead != NULL || !prv_take_token(ud))
+		return prv_pace_packet(ud, la, buffer, length);
+	return prv_send_packet(ud, la, buffer, length);
+}
+
 static void * prv_connect_server_callback(uint16_t serverID, void * userData) {
 	llwm_userdata * ud = userData;
 	lua_State * L = ud->L;
@@ -115,10 +625,19 @@ static void * prv_connect_server_callback(uint16_t serverID, void * userData) {
 		luaL_error(L, "Memory allocation problem when 'prv_connect_server_callback'");
 	la->host = strdup(host);
 	la->port = port;
+	prv_resolve_addr(la);
+	prv_add_session(ud, la);
 
 	return la;
 }
 
+// Release the objects built by llwm_init before an error.
+static void prv_free_objects(lwm2m_object_t ** objArray, int count) {
+	int i;
+	for (i = 0; i < count; i++)
+		free_lua_object(objArray[i]);
+}
+
 static int llwm_init(lua_State *L) {
 	// 1st parameter : should be end point name.
 	char * endpointName = luaL_checkstring(L, 1);
@@ -133,22 +652,75 @@ static int llwm_init(lua_State *L) {
 	// 3rd parameter : should be a callback.
 	luaL_checktype(L, 3, LUA_TFUNCTION);
 
-	// 4rd parameter : should be a callback.
-	luaL_checktype(L, 4, LUA_TFUNCTION);
+	// 4rd parameter : should be a callback (optional if a socket is bound).
+	if (!lua_isnoneornil(L, 4))
+		luaL_checktype(L, 4, LUA_TFUNCTION);
+
+	// 5th parameter : optional store keeping the state of the context
+	// (referenced once the context is built).
+	llwm_store * store = NULL;
+	if (!lua_isnoneornil(L, 5)) {
+		store = (llwm_store *) luaL_checkudata(L, 5, "lualwm2m.store");
+		if (store->header == NULL)
+			return luaL_error(L, "bad argument #5 to 'init' (store is closed)");
+		if (strlen(endpointName) >= LLWM_STORE_ENDPOINT_SIZE)
+			return luaL_error(L,
+					"bad argument #1 to 'init' (endpoint name is too long to be stored)");
+	}
+	lua_settop(L, 5);
 
 	// Create llwm userdata object and set its metatable.
-	llwm_userdata * lwu = lua_newuserdata(L, sizeof(llwm_userdata)); // stack: endpoint, tableobj, connectcallback, sendcallback, lwu
+	llwm_userdata * lwu = lua_newuserdata(L, sizeof(llwm_userdata)); // stack: endpoint, tableobj, connectcallback, sendcallback, store, lwu
 	lwu->L = L;
 	lwu->sendCallbackRef = LUA_NOREF;
 	lwu->connectServerCallbackRef = LUA_NOREF;
+	lwu->timerMode = 0;
+	lwu->nextStep = 0;
+	lwu->sock = -1;
+	lwu->epollfd = -1;
+	lwu->running = 0;
+	memset(lwu->sessions, 0, sizeof(lwu->sessions));
+	lwu->fleet = NULL;
+	lwu->fleetIndex = -1;
+	lwu->fleetRef = LUA_NOREF;
+	lwu->batchSend = 0;
+	lwu->batchCallbackRef = LUA_NOREF;
+	lwu->useBuffers = 0;
+	lwu->bufferPoolRef = LUA_NOREF;
+	lwu->buffersUsed = 0;
+	lwu->sendQueue = NULL;
+	lwu->sendCount = 0;
+	lwu->sendCapacity = 0;
+	lwu->sendBuffer = NULL;
+	lwu->sendBufferLength = 0;
+	lwu->sendBufferCapacity = 0;
+	lwu->changed = NULL;
+	lwu->changedCount = 0;
+	lwu->changedCapacity = 0;
+	memset(&lwu->stats, 0, sizeof(llwm_stats));
+	llwm_profile_init(&lwu->profiler, L);
+	lwu->startAt = 0;
+	prv_set_bucket(&lwu->bucket, 0, 0);
+	lwu->pacedHead = lwu->pacedTail = NULL;
+	lwu->store = NULL;
+	lwu->storeIndex = -1;
+	lwu->storeRef = LUA_NOREF;
+	lwu->resuming = 0;
+	lwu->closing = 0;
+	lwu->storeDirty = 0;
+	lwu->storeServers = 0;
+	lwu->nbResumed = 0;
 	lwu->ctx = NULL;
-	luaL_getmetatable(L, "lualwm2m.llwm"); // stack: endpoint, tableobj, connectcallback, sendcallback, lwu, metatable
-	lua_setmetatable(L, -2); // stack: endpoint, tableobj, connectcallback, sendcallback, lwu
-	lua_replace(L, 1); // stack: lwu, tableobj, connectcallback, sendcallback
+	luaL_getmetatable(L, "lualwm2m.llwm"); // stack: endpoint, tableobj, connectcallback, sendcallback, store, lwu, metatable
+	lua_setmetatable(L, -2); // stack: endpoint, tableobj, connectcallback, sendcallback, store, lwu
+	lua_replace(L, 1); // stack: lwu, tableobj, connectcallback, sendcallback, store
 
-	// Store callbacks in Lua registry to keep a reference on it.
-	int sendCallbackRef = luaL_ref(L, LUA_REGISTRYINDEX); // stack: lwu, tableobj, connectcallback
-	int connectServerCallbackRef = luaL_ref(L, LUA_REGISTRYINDEX); // stack: lwu, tableobj
+	// Store callbacks in Lua registry to keep a reference on it
+	// (released by __gc if an error is raised below).
+	lua_pushvalue(L, 4); // stack: lwu, tableobj, connectcallback, sendcallback, store, sendcallback
+	lwu->sendCallbackRef = luaL_ref(L, LUA_REGISTRYINDEX); // stack: lwu, tableobj, connectcallback, sendcallback, store
+	lua_pushvalue(L, 3); // stack: lwu, tableobj, connectcallback, sendcallback, store, connectcallback
+	lwu->connectServerCallbackRef = luaL_ref(L, LUA_REGISTRYINDEX); // stack: lwu, tableobj, connectcallback, sendcallback, store
 
 	// Manage "lwm2m objects" list :
 	// For each object in "lwm2m objects" list, create a "C lwm2m object".
@@ -156,41 +728,41 @@ static int llwm_init(lua_State *L) {
 	int i;
 	for (i = 1; i <= objListLen; i++) {
 		// Get object table.
-		lua_rawgeti(L, -1, i); // stack: lwu, tableobj, tableobj[i]
-		if (lua_type(L, -1) != LUA_TTABLE)
+		lua_rawgeti(L, 2, i); // stack: lwu, ..., store, tableobj[i]
+		if (lua_type(L, -1) != LUA_TTABLE) {
+			prv_free_objects(objArray, i - 1);
 			return luaL_error(L,
 					"bad argument #2 to 'init' (all element of the list should be a table with a 'id' field which is a number )");
+		}
 
 		// Check the id field is here.
-		lua_getfield(L, -1, "id"); // stack: lwu, tableobj, tableobj[i], tableobj[i].id
-		if (!lua_isnumber(L, -1))
+		lua_getfield(L, -1, "id"); // stack: lwu, ..., store, tableobj[i], tableobj[i].id
+		if (!lua_isnumber(L, -1)) {
+			prv_free_objects(objArray, i - 1);
 			return luaL_error(L,
 					"bad argument #2 to 'init' (all element of the list should be a table with a 'id' field which is a number)");
+		}
 
 		int id = (int) lua_tonumber(L, -1);
-		lua_pop(L, 1); // stack: lwu, tableobj, tableobj[i]
+		lua_pop(L, 1); // stack: lwu, ..., store, tableobj[i]
 
 		// Create Lua Object.
-		lwm2m_object_t * obj = get_lua_object(L, -1, id); //stack should not be modify by "get_lua_object".
+		lwm2m_object_t * obj = get_lua_object(L, -1, id, &lwu->stats,
+				&lwu->profiler); //stack should not be modify by "get_lua_object".
 		if (obj == NULL) {
 			// object can not be create, release previous one.
-			for (i--; i >= 1; i--) {
-				free(objArray[i - 1]);
-			}
+			prv_free_objects(objArray, i - 1);
 			return luaL_error(L,
 					"unable to create objects (Bad object structure or memory allocation problem ?)");
 		}
 		objArray[i - 1] = obj;
-		lua_pop(L, 1); // stack: lwu, tableobj
+		lua_pop(L, 1); // stack: lwu, ..., store
 	}
-	lua_pop(L, 1); // stack: lwu
 
 	// Context Initialization.
 	lwm2m_context_t * contextP = lwm2m_init(prv_connect_server_callback,
 			prv_buffer_send_callback, lwu);
 	lwu->ctx = contextP;
-	lwu->sendCallbackRef = sendCallbackRef;
-	lwu->connectServerCallbackRef = connectServerCallbackRef;
 
 	int res =  lwm2m_configure(contextP, endpointName, NULL, NULL, objListLen,
 			objArray);
@@ -198,16 +770,57 @@ static int llwm_init(lua_State *L) {
 		luaL_error(L,
 			"unable to initialize lwM2m context : configure failed (Bad object structure or memory allocation problem ?)");
 	}
+
+	// Keep a reference on the store, then attach the record of the endpoint,
+	// its state is resumed at start.
+	if (store != NULL) {
+		lwu->storeRef = luaL_ref(L, LUA_REGISTRYINDEX); // stack: lwu, tableobj, connectcallback, sendcallback
+		if (llwm_store_attach(lwu, store, endpointName) != 0)
+			luaL_error(L, "unable to initialize lwM2m context : store is full");
+	}
+	lua_settop(L, 1); // stack: lwu
 	return 1;
 }
 
+// Handle a packet received from the given session.
+static void prv_handle_packet(llwm_userdata * lwu, uint8_t * buffer,
+		size_t length, llwm_addr_t * la) {
+	int64_t start = llwm_monotonic_time_us();
+	lwu->stats.received++;
+	lwu->stats.bytesReceived += length;
+	lwm2m_handle_packet(lwu->ctx, buffer, length, la);
+	lwu->storeDirty = 1;
+	llwm_stats_record(&lwu->stats, LLWM_STAT_HANDLE, start);
+}
+
+// Start connection, resuming the state saved in the store if any.
+static void prv_start(llwm_userdata * lwu) {
+	if (lwu->store != NULL)
+		llwm_store_start(lwu);
+	else
+		lwm2m_start(lwu->ctx);
+}
+
+// Start connection after delay seconds (with a millisecond resolution).
+void llwm_schedule_start(llwm_userdata * lwu, double delay) {
+	if (delay > 0) {
+		lwu->startAt = llwm_monotonic_time_ms() + (int64_t) (delay * 1000);
+		prv_set_next_step(lwu, lwu->startAt);
+		return;
+	}
+
+	lwu->startAt = 0;
+	prv_start(lwu);
+	llwm_flush(lwu);
+	prv_set_next_step(lwu, 0);
+}
+
 static int llwm_start(lua_State *L) {
 	// Get llwm userdata.
 	llwm_userdata * lwu = checkllwm(L, "start");
 
-	// Start connection
-	lwm2m_start(lwu->ctx);
-
+	// Start connection, now or after the given delay in seconds.
+	llwm_schedule_start(lwu, luaL_optnumber(L, 2, 0));
 	return 0;
 }
 
@@ -215,36 +828,203 @@ static int llwm_handle(lua_State *L) {
 	// Get llwm userdata.
 	llwm_userdata * lwu = checkllwm(L, "handle");
 
-	// Get data buffer.
+	// Get data buffer (string or buffer).
 	size_t length;
-	uint8_t * buffer = (uint8_t*) luaL_checklstring(L, 2, &length);
+	uint8_t * buffer = (uint8_t*) llwm_todata(L, 2, &length);
+	if (buffer == NULL)
+		return luaL_argerror(L, 2, "string or valid buffer expected");
 
 	// Get server address.
 	char* host = luaL_checkstring(L, 3);
 	int port = luaL_checkint(L, 4);
 
-	// HACK : https://github.com/01org/liblwm2m/pull/18#issuecomment-45501037
-	// find session object in the server list.
-	lwm2m_server_t * targetP;
+	// Find session object.
+	llwm_addr_t * la = prv_find_session(lwu, host, port);
+
+	// Handle packet
+	if (la == NULL) {
+		lwu->stats.dropped++;
+	} else {
+		prv_handle_packet(lwu, buffer, length, la);
+		reset_lua_objects(lwu->ctx);
+		llwm_flush(lwu);
+		// a packet could create new transactions : next step is due now.
+		prv_set_next_step(lwu, 0);
+	}
+
+	return 0;
+}
+
+static int llwm_handle_many(lua_State *L) {
+	// Get llwm userdata.
+	llwm_userdata * lwu = checkllwm(L, "handlemany");
+
+	// Get list of packets : {{data, host, port}, ...}
+	luaL_checktype(L, 2, LUA_TTABLE);
+	size_t nbPackets = lua_objlen(L, 2);
+
+	// Handle all packets, session is only searched when the source changes.
+	// (host strings are interned by Lua : same host means same pointer)
 	llwm_addr_t * la = NULL;
-	bool found = false;
-	targetP = lwu->ctx->serverList;
-	while (targetP != NULL && !found) {
-		// get host and port of the target
-		llwm_addr_t * session = (llwm_addr_t *) targetP->sessionH;
-		if (session != NULL && session->port == port
-				&& strcmp(session->host, host) == 0) {
-			la = session;
-			found = true;
+	const char * lastHost = NULL;
+	int lastPort = -1;
+	int handled = 0;
+	size_t i;
+	for (i = 1; i <= nbPackets && lwu->ctx != NULL; i++) {
+		lua_rawgeti(L, 2, i); // stack: lwu, packets, packet
+		if (!lua_istable(L, -1))
+			return luaL_error(L,
+					"bad argument #2 to 'handlemany' (packet %d should be a table {data, host, port})",
+					(int) i);
+		lua_rawgeti(L, -1, 1); // stack: lwu, packets, packet, data
+		lua_rawgeti(L, -2, 2); // stack: lwu, packets, packet, data, host
+		lua_rawgeti(L, -3, 3); // stack: lwu, packets, packet, data, host, port
+		size_t length;
+		const char * buffer = (const char *) llwm_todata(L, -3, &length);
+		const char * host = lua_tostring(L, -2);
+		int port = lua_tointeger(L, -1);
+		if (buffer == NULL || host == NULL)
+			return luaL_error(L,
+					"bad argument #2 to 'handlemany' (packet %d should be a table {data, host, port})",
+					(int) i);
+
+		if (host != lastHost || port != lastPort) {
+			la = prv_find_session(lwu, host, port);
+			lastHost = host;
+			lastPort = port;
+		}
+		if (la == NULL) {
+			lwu->stats.dropped++;
 		} else {
-			targetP = targetP->next;
+			prv_handle_packet(lwu, (uint8_t *) buffer, length, la);
+			handled = 1;
 		}
+		lua_pop(L, 4); // stack: lwu, packets
 	}
 
-	// Handle packet
-	if (found)
-		lwm2m_handle_packet(lwu->ctx, buffer, length, la);
+	// Send all responses at once.
+	if (lwu->ctx != NULL) {
+		reset_lua_objects(lwu->ctx);
+		llwm_flush(lwu);
+		if (handled)
+			prv_set_next_step(lwu, 0);
+	}
+
+	return 0;
+}
+
+// Get the uri at the given index of the stack : a uri handle (see lwm2m.uri) or a string.
+// return 1 if ok, 0 if the uri syntax is wrong.
+static int prv_to_uri(lua_State * L, int index, lwm2m_uri_t * uriP) {
+	if (lua_type(L, index) == LUA_TUSERDATA) {
+		lwm2m_uri_t * handle = (lwm2m_uri_t *) luaL_checkudata(L, index,
+				"lualwm2m.uri");
+		*uriP = *handle;
+		return 1;
+	}
+	size_t length;
+	uint8_t * uriPath = (uint8_t*) luaL_checklstring(L, index, &length);
+	return lwm2m_stringToUri(uriPath, length, uriP) != 0;
+}
+
+// Queue a changed uri, each uri is notified once at the next step.
+// return 0 if ok or -1 if memory can not be allocated.
+static int prv_add_change(llwm_userdata * lwu, lwm2m_uri_t * uriP) {
+	// Cached values of this uri are no more valid.
+	invalidate_lua_objects(lwu->ctx, uriP);
 
+	// Already queued ?
+	int i;
+	for (i = 0; i < lwu->changedCount; i++) {
+		lwm2m_uri_t * c = &lwu->changed[i];
+		if (c->flag == uriP->flag && c->objectId == uriP->objectId
+				&& c->instanceId == uriP->instanceId
+				&& c->resourceId == uriP->resourceId)
+			return 0;
+	}
+
+	if (lwu->changedCount == lwu->changedCapacity) {
+		int capacity = lwu->changedCapacity ? lwu->changedCapacity * 2 : 16;
+		lwm2m_uri_t * changed = realloc(lwu->changed,
+				capacity * sizeof(lwm2m_uri_t));
+		if (changed == NULL)
+			return -1;
+		lwu->changed = changed;
+		lwu->changedCapacity = capacity;
+	}
+	lwu->changed[lwu->changedCount++] = *uriP;
+	return 0;
+}
+
+// Notify wakaama of all uris changed since the last step.
+static void prv_notify_changes(llwm_userdata * lwu) {
+	int i;
+	for (i = 0; i < lwu->changedCount; i++)
+		lwm2m_resource_value_changed(lwu->ctx, &lwu->changed[i]);
+	lwu->changedCount = 0;
+}
+
+// Do a lwm2m step if needed and store in timeoutP the number of milliseconds
+// before the next needed step.
+// return 0 if ok or the error returned by lwm2m_step.
+int llwm_dostep(llwm_userdata * lwu, int64_t * timeoutP) {
+	// In timer mode, nothing to do while the deadline is not reached.
+	int64_t nowms = llwm_monotonic_time_ms();
+	if (lwu->timerMode && nowms < lwu->nextStep) {
+		*timeoutP = lwu->nextStep - nowms;
+		return 0;
+	}
+
+	// Start connection when its delay is over (see llwm_schedule_start).
+	if (lwu->startAt != 0) {
+		if (nowms < lwu->startAt) {
+			prv_set_next_step(lwu, lwu->startAt);
+			*timeoutP = lwu->startAt - nowms;
+			return 0;
+		}
+		lwu->startAt = 0;
+		prv_start(lwu);
+	}
+
+	// Packets held back by the rate limiter are sent before new ones.
+	prv_drain_paced(lwu, 0);
+
+	// Notify uris and values changed since the last step
+	// (held back values are notified later, regarding notification attributes).
+	int64_t start = llwm_monotonic_time_us();
+	time_t now = llwm_monotonic_time();
+	time_t nextNotify = now + LLWM_MAX_STEP_TIMEOUT;
+	prv_notify_changes(lwu);
+	notify_lua_objects(lwu->ctx, now, &nextNotify);
+
+	// Resume pending async calls, while some are pending, step every second.
+	if (resume_lua_objects(lwu->ctx) > 0 && now + 1 < nextNotify)
+		nextNotify = now + 1;
+
+	// Do the step, wakaama lowers timeout to the next time it needs to be called.
+	time_t timeout = LLWM_MAX_STEP_TIMEOUT;
+	int res = lwm2m_step(lwu->ctx, &timeout);
+	reset_lua_objects(lwu->ctx);
+	llwm_flush(lwu);
+	llwm_store_save(lwu);
+	llwm_stats_record(&lwu->stats, LLWM_STAT_STEP, start);
+	if (res != 0) {
+		prv_set_next_step(lwu, 0);
+		return res;
+	}
+	if (nextNotify - now < timeout)
+		timeout = nextNotify - now;
+	if (timeout < 0)
+		timeout = 0;
+	int64_t timeoutms = (int64_t) timeout * 1000;
+	// While packets are held back, step again as soon as a send token is earned.
+	if (lwu->pacedHead != NULL) {
+		int64_t wait = prv_paced_wait(lwu);
+		if (wait < timeoutms)
+			timeoutms = wait;
+	}
+	prv_set_next_step(lwu, nowms + timeoutms);
+	*timeoutP = timeoutms;
 	return 0;
 }
 
@@ -252,34 +1032,537 @@ static int llwm_step(lua_State *L) {
 	// Get llwm userdata.
 	llwm_userdata * lwu = checkllwm(L, "step");
 
-	// TODO make this arguments available in lua.
-	struct timeval tv;
-	tv.tv_sec = 60;
-	tv.tv_usec = 0;
-	lwm2m_step(lwu->ctx, &(tv.tv_sec));
+	// Get max timeout (optional).
+	time_t maxTimeout = luaL_optint(L, 2, LLWM_MAX_STEP_TIMEOUT);
+	if (maxTimeout < 0)
+		maxTimeout = 0;
+
+	int64_t timeout;
+	int res = llwm_dostep(lwu, &timeout);
+	if (res != 0) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "step failed (error %d)", res);
+		return 2;
+	}
+
+	// Return the number of seconds (with ms precision) before the next needed step.
+	if (timeout > (int64_t) maxTimeout * 1000)
+		timeout = (int64_t) maxTimeout * 1000;
+	lua_pushnumber(L, timeout / 1000.0);
+	return 1;
+}
+
+static int llwm_timer_mode(lua_State *L) {
+	// Get llwm userdata.
+	llwm_userdata * lwu = checkllwm(L, "timermode");
+
+	// Enable or disable timer mode.
+	lwu->timerMode = lua_toboolean(L, 2);
+	prv_set_next_step(lwu, 0);
+
+	return 0;
+}
+
+// Read all pending packets on the socket owned by the binding and handle them.
+void llwm_receive(llwm_userdata * lwu) {
+	uint8_t buffers[LLWM_MAX_RECV_BATCH][LLWM_MAX_PACKET_SIZE];
+	struct sockaddr_storage addrs[LLWM_MAX_RECV_BATCH];
+	struct iovec iovecs[LLWM_MAX_RECV_BATCH];
+	struct mmsghdr msgs[LLWM_MAX_RECV_BATCH];
+
+	int handled = 0;
+	while (lwu->ctx != NULL && lwu->sock >= 0) {
+		// Read a batch of packets.
+		int i;
+		for (i = 0; i < LLWM_MAX_RECV_BATCH; i++) {
+			iovecs[i].iov_base = buffers[i];
+			iovecs[i].iov_len = LLWM_MAX_PACKET_SIZE;
+			memset(&msgs[i], 0, sizeof(struct mmsghdr));
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+			msgs[i].msg_hdr.msg_iov = &iovecs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		int n = recvmmsg(lwu->sock, msgs, LLWM_MAX_RECV_BATCH, MSG_DONTWAIT,
+				NULL);
+		if (n <= 0)
+			break; // EAGAIN : no more data (or socket error).
+
+		// Handle them, session is only searched when the source changes.
+		llwm_addr_t * la = NULL;
+		struct sockaddr * lastAddr = NULL;
+		for (i = 0; i < n && lwu->ctx != NULL; i++) {
+			struct sockaddr * addr = (struct sockaddr *) &addrs[i];
+			if (lastAddr == NULL || !prv_addr_equals(lastAddr, addr)) {
+				la = prv_find_session_by_addr(lwu, addr);
+				lastAddr = addr;
+			}
+			if (la == NULL) {
+				lwu->stats.dropped++;
+			} else {
+				prv_handle_packet(lwu, buffers[i], msgs[i].msg_len, la);
+				handled = 1;
+			}
+		}
+		if (n < LLWM_MAX_RECV_BATCH)
+			break; // socket is drained.
+	}
+
+	// Send all responses at once.
+	if (lwu->ctx != NULL)
+		reset_lua_objects(lwu->ctx);
+	llwm_flush(lwu);
+	if (handled)
+		prv_set_next_step(lwu, 0);
+}
+
+// Close the socket owned by the binding.
+static void prv_close_socket(llwm_userdata * lwu) {
+	if (lwu->epollfd >= 0) {
+		close(lwu->epollfd);
+		lwu->epollfd = -1;
+	}
+	if (lwu->sock >= 0) {
+		close(lwu->sock);
+		lwu->sock = -1;
+	}
+	lwu->running = 0;
+}
+
+static int llwm_bind(lua_State *L) {
+	// Get llwm userdata.
+	llwm_userdata * lwu = checkllwm(L, "bind");
+
+	// Get local port and address.
+	int port = luaL_checkint(L, 2);
+	const char * address = luaL_optstring(L, 3, "0.0.0.0");
+	if (lwu->sock >= 0)
+		return luaL_error(L, "bad argument #1 to 'bind' (socket already bound)");
+
+	// Resolve local address.
+	char portstr[8];
+	snprintf(portstr, sizeof(portstr), "%d", port);
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_PASSIVE;
+	struct addrinfo * res = NULL;
+	if (getaddrinfo(address, portstr, &hints, &res) != 0 || res == NULL) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "unable to resolve local address '%s'", address);
+		return 2;
+	}
+
+	// Create a nonblocking UDP socket and register it in a new epoll instance.
+	int sock = socket(res->ai_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			0);
+	if (sock < 0 || bind(sock, res->ai_addr, res->ai_addrlen) < 0) {
+		int err = errno;
+		freeaddrinfo(res);
+		if (sock >= 0)
+			close(sock);
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(err));
+		return 2;
+	}
+	freeaddrinfo(res);
+
+	int epollfd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = sock;
+	if (epollfd < 0 || epoll_ctl(epollfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+		int err = errno;
+		if (epollfd >= 0)
+			close(epollfd);
+		close(sock);
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(err));
+		return 2;
+	}
+
+	lwu->sock = sock;
+	lwu->epollfd = epollfd;
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+// Loop of llwm_run (called in protected mode) : step, then wait for packets
+// until the next step is needed.
+static int prv_run_loop(lua_State *L) {
+	llwm_userdata * lwu = checkllwm(L, "run");
+
+	// Get duration in seconds (optional, run until 'stop' if nil).
+	int hasDeadline = !lua_isnoneornil(L, 2);
+	int64_t deadline = llwm_monotonic_time_ms()
+			+ (int64_t) (luaL_optnumber(L, 2, 0) * 1000);
+
+	// Callbacks may leave values on the stack : it is restored after each of
+	// them, else it would grow for ever.
+	int top = lua_gettop(L);
+	struct epoll_event events[LLWM_MAX_EVENTS];
+	while (lwu->running && lwu->ctx != NULL && lwu->sock >= 0) {
+		int64_t waitms;
+		int res = llwm_dostep(lwu, &waitms);
+		lua_settop(L, top);
+		if (res != 0) {
+			lua_pushnil(L);
+			lua_pushfstring(L, "step failed (error %d)", res);
+			return 2;
+		}
+		if (!lwu->running || lwu->ctx == NULL || lwu->sock < 0)
+			break;
+
+		if (hasDeadline) {
+			int64_t remaining = deadline - llwm_monotonic_time_ms();
+			if (remaining <= 0)
+				break;
+			if (remaining < waitms)
+				waitms = remaining;
+		}
+
+		int n = epoll_wait(lwu->epollfd, events, LLWM_MAX_EVENTS, waitms);
+		if (n < 0 && errno != EINTR) {
+			int err = errno;
+			lua_pushnil(L);
+			lua_pushstring(L, strerror(err));
+			return 2;
+		}
+		if (n > 0) {
+			llwm_receive(lwu);
+			lua_settop(L, top);
+		}
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int llwm_run(lua_State *L) {
+	// Get llwm userdata.
+	llwm_userdata * lwu = checkllwm(L, "run");
+	if (lwu->sock < 0)
+		return luaL_error(L,
+				"bad argument #1 to 'run' (no socket bound, call 'bind' first)");
+
+	// Run the loop in protected mode : an error raised by a callback stops
+	// the loop cleanly before it is raised again.
+	lua_settop(L, 2); // stack: lwu, duration
+	lua_pushcfunction(L, prv_run_loop); // stack: lwu, duration, loop
+	lua_insert(L, 1); // stack: loop, lwu, duration
+	lwu->running = 1;
+	int res = lua_pcall(L, 2, LUA_MULTRET, 0);
+	lwu->running = 0;
+	if (res != 0) {
+		llwm_buffer_release(lwu, 0);
+		return lua_error(L);
+	}
+	return lua_gettop(L);
+}
+
+static int llwm_stop(lua_State *L) {
+	// Get llwm userdata.
+	llwm_userdata * lwu = checkllwm(L, "stop");
+
+	// Native loop will return after the current iteration.
+	lwu->running = 0;
+	return 0;
+}
+
+static int llwm_batch_send(lua_State *L) {
+	// Get llwm userdata.
+	llwm_userdata * lwu = checkllwm(L, "batchsend");
+
+	// Get parameters : enable flag and batch callback (optional).
+	int enable = lua_toboolean(L, 2);
+	if (!lua_isnoneornil(L, 3))
+		luaL_checktype(L, 3, LUA_TFUNCTION);
+	lua_settop(L, 3);
+
+	// Send packets queued in the previous mode.
+	llwm_flush(lwu);
+
+	// Replace batch callback.
+	luaL_unref(L, LUA_REGISTRYINDEX, lwu->batchCallbackRef);
+	lwu->batchCallbackRef = luaL_ref(L, LUA_REGISTRYINDEX);
+	lwu->batchSend = enable;
 
 	return 0;
 }
 
+// Get the registration state of the context (the less advanced of all its servers).
+const char * llwm_state(llwm_userdata * lwu) {
+	if (lwu->ctx == NULL)
+		return "closed";
+
+	lwm2m_server_t * targetP = lwu->ctx->serverList;
+	if (targetP == NULL)
+		return "unregistered";
+	int registered = 1;
+	while (targetP != NULL) {
+		if (targetP->status == STATE_REG_FAILED)
+			return "failed";
+		if (targetP->status == STATE_REG_PENDING)
+			return "pending";
+		if (targetP->status != STATE_REGISTERED)
+			registered = 0;
+		targetP = targetP->next;
+	}
+	return registered ? "registered" : "unregistered";
+}
+
+static int llwm_use_buffers(lua_State *L) {
+	// Get llwm userdata.
+	llwm_userdata * lwu = checkllwm(L, "usebuffers");
+
+	// Packets are given to send callbacks as buffers instead of strings.
+	lwu->useBuffers = lua_toboolean(L, 2);
+	return 0;
+}
+
+static int llwm_get_state(lua_State *L) {
+	// Get llwm userdata.
+	llwm_userdata * lwu = checkllwm(L, "state");
+
+	// Push state and number of seconds before the next step.
+	lua_pushstring(L, llwm_state(lwu));
+	int64_t now = llwm_monotonic_time_ms();
+	lua_pushnumber(L, lwu->nextStep > now ? (lwu->nextStep - now) / 1000.0 : 0);
+	return 2;
+}
+
 static int llwm_resource_changed(lua_State *L) {
 	// Get llwm userdata.
 	llwm_userdata *lwu = checkllwm(L, "resource_changed");
 
+	// Get URI of resource which changed.
+	lwm2m_uri_t uri;
+	if (!prv_to_uri(L, 2, &uri)) {
+		lua_pushnil(L);
+		lua_pushstring(L, "resource uri syntax error");
+		return 2;
+	}
+
+	// Queue the change, it will be notified at the next step.
+	if (prv_add_change(lwu, &uri) != 0)
+		return luaL_error(L, "resourcechanged: memory allocation error");
+	prv_set_next_step(lwu, 0);
+	return 0;
+}
+
+static int llwm_resources_changed(lua_State *L) {
+	// Get llwm userdata.
+	llwm_userdata *lwu = checkllwm(L, "resources_changed");
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	// Queue all changes, they will be notified at the next step.
+	int i;
+	int n = lua_objlen(L, 2);
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, 2, i); // stack: lwu, uris, uri
+		lwm2m_uri_t uri;
+		if (!prv_to_uri(L, -1, &uri)) {
+			lua_pushnil(L);
+			lua_pushfstring(L, "resource uri syntax error (uri %d)", i);
+			return 2;
+		}
+		if (prv_add_change(lwu, &uri) != 0)
+			return luaL_error(L, "resourceschanged: memory allocation error");
+		lua_pop(L, 1); // stack: lwu, uris
+	}
+	if (n > 0)
+		prv_set_next_step(lwu, 0);
+	return 0;
+}
+
+static int llwm_set_attributes(lua_State *L) {
+	// Get llwm userdata.
+	llwm_userdata *lwu = checkllwm(L, "set_attributes");
+
 	// Get parameters.
-	size_t length;
-	uint8_t * uriPath = (uint8_t*) luaL_checklstring(L, 2, &length);
+	lwm2m_uri_t uri;
+	if (!prv_to_uri(L, 2, &uri)) {
+		lua_pushnil(L);
+		lua_pushstring(L, "resource uri syntax error");
+		return 2;
+	}
+	lua_settop(L, 3);
+
+	// Set attributes, next step computes the new notification times.
+	if (set_lua_object_attributes(lwu->ctx, &uri, llwm_monotonic_time(), L, 3)
+			!= 0) {
+		lua_pushnil(L);
+		lua_insert(L, -2);
+		return 2;
+	}
+	prv_set_next_step(lwu, 0);
+	lua_pushboolean(L, 1);
+	return 1;
+}
 
-	// Create URI of resource which changed.
+static int llwm_uri_new(lua_State *L) {
+	// Parse uri once.
 	lwm2m_uri_t uri;
-	int result = lwm2m_stringToUri(uriPath, length, &uri);
-	if (result == 0) {
+	size_t length;
+	uint8_t * uriPath = (uint8_t*) luaL_checklstring(L, 1, &length);
+	if (lwm2m_stringToUri(uriPath, length, &uri) == 0) {
 		lua_pushnil(L);
 		lua_pushstring(L, "resource uri syntax error");
 		return 2;
 	}
 
-	//notify the change.
-	lwm2m_resource_value_changed(lwu->ctx, &uri);
+	// Create uri handle.
+	lwm2m_uri_t * handle = (lwm2m_uri_t *) lua_newuserdata(L,
+			sizeof(lwm2m_uri_t)); // stack: path, handle
+	*handle = uri;
+	luaL_getmetatable(L, "lualwm2m.uri"); // stack: path, handle, metatable
+	lua_setmetatable(L, -2); // stack: path, handle
+	return 1;
+}
+
+static int llwm_uri_tostring(lua_State *L) {
+	lwm2m_uri_t * uri = (lwm2m_uri_t *) luaL_checkudata(L, 1, "lualwm2m.uri");
+	lua_pushfstring(L, "/%d", uri->objectId);
+	if (uri->flag & LWM2M_URI_FLAG_INSTANCE_ID) {
+		lua_pushfstring(L, "/%d", uri->instanceId);
+		lua_concat(L, 2);
+	}
+	if (uri->flag & LWM2M_URI_FLAG_RESOURCE_ID) {
+		lua_pushfstring(L, "/%d", uri->resourceId);
+		lua_concat(L, 2);
+	}
+	return 1;
+}
+
+static int llwm_set(lua_State *L) {
+	// Get llwm userdata.
+	llwm_userdata *lwu = checkllwm(L, "set");
+
+	// Get parameters.
+	int objId = luaL_checkinteger(L, 2);
+	int instanceId = luaL_checkinteger(L, 3);
+
+	// Store value(s) : ll:set(obj, inst, res, value) or ll:set(obj, inst, {[res] = value, ...})
+	int changed = 0;
+	if (lua_istable(L, 4)) {
+		lua_settop(L, 4);
+		lua_pushnil(L); // stack: lwu, obj, inst, values, nil
+		while (lua_next(L, 4) != 0) { // stack: lwu, obj, inst, values, resourceId, value
+			if (lua_isnumber(L, -2)) {
+				int res = set_lua_object_value(lwu->ctx, objId, instanceId,
+						lua_tointeger(L, -2), L, -1);
+				if (res < 0) {
+					// Values set before the error are notified anyway.
+					if (changed > 0)
+						prv_set_next_step(lwu, 0);
+					lua_pushnil(L);
+					lua_pushfstring(L, "%s (resource %d)", lua_tostring(L, -2),
+							lua_tointeger(L, -4));
+					return 2;
+				}
+				changed += res;
+			}
+			lua_pop(L, 1); // stack: lwu, obj, inst, values, resourceId
+		}
+	} else {
+		int resourceId = luaL_checkinteger(L, 4);
+		luaL_checkany(L, 5);
+		int res = set_lua_object_value(lwu->ctx, objId, instanceId, resourceId,
+				L, 5);
+		if (res < 0) {
+			lua_pushnil(L);
+			lua_insert(L, -2);
+			return 2;
+		}
+		changed = res;
+	}
+
+	// Changes are notified at the next step.
+	if (changed > 0)
+		prv_set_next_step(lwu, 0);
+	lua_pushinteger(L, changed);
+	return 1;
+}
+
+static int llwm_redefine(lua_State *L) {
+	// Get llwm userdata.
+	llwm_userdata *lwu = checkllwm(L, "redefine");
+
+	// Get parameters.
+	int objId = luaL_checkinteger(L, 2);
+
+	// Search the object and reload its definition.
+	int i;
+	for (i = 0; i < lwu->ctx->numObject; i++) {
+		if (lwu->ctx->objectList[i]->objID == objId) {
+			redefine_lua_object(lwu->ctx->objectList[i]);
+			lua_pushboolean(L, 1);
+			return 1;
+		}
+	}
+	lua_pushnil(L);
+	lua_pushstring(L, "object not found");
+	return 2;
+}
+
+static int llwm_get_stats(lua_State *L) {
+	// Get llwm userdata.
+	llwm_userdata *lwu = checkllwm(L, "stats");
+
+	// Push statistics, reset them if asked.
+	llwm_stats_push(L, &lwu->stats);
+	if (lua_toboolean(L, 2))
+		memset(&lwu->stats, 0, sizeof(llwm_stats));
+	return 1;
+}
+
+static int llwm_profile(lua_State *L) {
+	// Get llwm userdata.
+	llwm_userdata *lwu = checkllwm(L, "profile");
+
+	// Get parameters : enable flag, threshold in microseconds and hook (optional).
+	int enable = lua_toboolean(L, 2);
+	lua_Number threshold = luaL_optnumber(L, 3, 0);
+	if (!lua_isnoneornil(L, 4))
+		luaL_checktype(L, 4, LUA_TFUNCTION);
+	lua_settop(L, 4);
+
+	// Start (or stop) profiling from scratch.
+	llwm_profile_enable(&lwu->profiler, enable, (int64_t) threshold,
+			luaL_ref(L, LUA_REGISTRYINDEX));
+	return 0;
+}
+
+static int llwm_profile_top(lua_State *L) {
+	// Get llwm userdata.
+	llwm_userdata *lwu = checkllwm(L, "profiletop");
+
+	// Push the most expensive callbacks and the number of callbacks not counted.
+	llwm_profile_push_top(L, &lwu->profiler, luaL_optint(L, 2, 10));
+	return 2;
+}
+
+static int llwm_ratelimit(lua_State *L) {
+	// Get llwm userdata.
+	llwm_userdata *lwu = checkllwm(L, "ratelimit");
+
+	// Limit sent packets to rate by second, with bursts of burst packets
+	// (nil or 0 : no limit).
+	prv_set_bucket(&lwu->bucket, luaL_optnumber(L, 2, 0),
+			luaL_optnumber(L, 3, 0));
+	prv_set_next_step(lwu, 0);
+	return 0;
+}
+
+static int llwm_global_ratelimit(lua_State *L) {
+	// Limit packets sent by all contexts (same parameters as ll:ratelimit).
+	double rate = luaL_optnumber(L, 1, 0);
+	double burst = luaL_optnumber(L, 2, 0);
+	pthread_mutex_lock(&globalBucketLock);
+	prv_set_bucket(&globalBucket, rate, burst);
+	pthread_mutex_unlock(&globalBucketLock);
 	return 0;
 }
 
@@ -288,17 +1571,58 @@ static int llwm_close(lua_State *L) {
 	llwm_userdata* lwu = (llwm_userdata*) luaL_checkudata(L, 1,
 			"lualwm2m.llwm");
 
-	// Close lwm2m context.
+	// Close lwm2m context : held back packets are sent first, then the
+	// deregistration without rate limit. Send errors are not raised (close can
+	// be called by __gc).
 	if (lwu->ctx) {
+		lwu->closing = 1;
+		prv_drain_paced(lwu, 1);
+		llwm_flush(lwu);
+		lwu->bucket.rate = 0;
 		lwm2m_close(lwu->ctx);
-		lwu->ctx->userData = NULL;
+		lwu->ctx = NULL;
+		// (the deregistration may be held back by the global rate limit)
+		prv_drain_paced(lwu, 1);
+		llwm_flush(lwu);
+		lwu->closing = 0;
 	}
 
+	// A closed context has nothing to resume.
+	llwm_store_forget(lwu);
+	luaL_unref(L, LUA_REGISTRYINDEX, lwu->storeRef);
+	lwu->storeRef = LUA_NOREF;
+
 	// Release callbacks.
 	luaL_unref(L, LUA_REGISTRYINDEX, lwu->sendCallbackRef);
 	lwu->sendCallbackRef = LUA_NOREF;
 	luaL_unref(L, LUA_REGISTRYINDEX, lwu->connectServerCallbackRef);
 	lwu->connectServerCallbackRef = LUA_NOREF;
+	luaL_unref(L, LUA_REGISTRYINDEX, lwu->batchCallbackRef);
+	lwu->batchCallbackRef = LUA_NOREF;
+	luaL_unref(L, LUA_REGISTRYINDEX, lwu->bufferPoolRef);
+	lwu->bufferPoolRef = LUA_NOREF;
+
+	// Release send queue.
+	free(lwu->sendQueue);
+	lwu->sendQueue = NULL;
+	lwu->sendCount = lwu->sendCapacity = 0;
+	free(lwu->sendBuffer);
+	lwu->sendBuffer = NULL;
+	lwu->sendBufferLength = lwu->sendBufferCapacity = 0;
+
+	// Release profiler.
+	llwm_profile_release(&lwu->profiler);
+
+	// Release changed uris.
+	free(lwu->changed);
+	lwu->changed = NULL;
+	lwu->changedCount = lwu->changedCapacity = 0;
+
+	// Leave fleet, release socket and sessions.
+	if (lwu->fleet != NULL)
+		llwm_fleet_remove(lwu);
+	prv_close_socket(lwu);
+	prv_free_sessions(lwu);
 
 	lwu->ctx = NULL;
 
@@ -306,12 +1630,21 @@ static int llwm_close(lua_State *L) {
 }
 
 static const struct luaL_Reg llwm_objmeths[] = { { "handle", llwm_handle }, {
-		"start", llwm_start }, { "close", llwm_close }, { "step", llwm_step }, {
-		"resourcechanged", llwm_resource_changed }, { "__gc", llwm_close }, {
-NULL, NULL } };
+		"handlemany", llwm_handle_many }, { "start", llwm_start }, { "close",
+		llwm_close }, { "step", llwm_step }, { "timermode", llwm_timer_mode }, {
+		"bind", llwm_bind }, { "run", llwm_run }, { "stop", llwm_stop }, {
+		"state", llwm_get_state }, { "batchsend", llwm_batch_send }, {
+		"resourcechanged", llwm_resource_changed }, { "resourceschanged",
+		llwm_resources_changed }, { "setattributes", llwm_set_attributes }, {
+		"redefine", llwm_redefine }, { "set", llwm_set }, { "usebuffers",
+		llwm_use_buffers }, { "stats", llwm_get_stats }, { "profile", llwm_profile }, {
+		"profiletop", llwm_profile_top }, { "ratelimit", llwm_ratelimit }, {
+		"__gc", llwm_close }, { NULL, NULL } };
 
 static const struct luaL_Reg llwm_modulefuncs[] = { { "init", llwm_init }, {
-NULL, NULL } };
+		"fleet", llwm_fleet_new }, { "workers", llwm_workers_new }, { "uri",
+		llwm_uri_new }, { "ratelimit", llwm_global_ratelimit }, { "store",
+		llwm_store_new }, { NULL, NULL } };
 
 int luaopen_lwm2m(lua_State *L) {
 	// Define llwm object metatable.
@@ -323,8 +1656,25 @@ int luaopen_lwm2m(lua_State *L) {
 
 	// Register llwm object methods : set methods to table on top of the stack
 	luaL_register(L, NULL, llwm_objmeths); // stack: metatable
+	lua_pop(L, 1); // stack:
+
+	// Define uri handle metatable.
+	luaL_newmetatable(L, "lualwm2m.uri"); // stack: metatable
+	lua_pushcfunction(L, llwm_uri_tostring); // stack: metatable, tostring
+	lua_setfield(L, -2, "__tostring"); // stack: metatable
+	lua_pop(L, 1); // stack:
+
+	// Define buffer object metatable.
+	llwm_buffer_register(L); // stack:
+
+	// Define fleet and workers object metatables.
+	llwm_fleet_register(L); // stack:
+	llwm_workers_register(L); // stack:
+
+	// Define store object metatable.
+	llwm_store_register(L); // stack:
 
 	// Register module functions.
-	luaL_register(L, "lwm2m", llwm_modulefuncs); // stack: metatable, functable
+	luaL_register(L, "lwm2m", llwm_modulefuncs); // stack: functable
 	return 1;
 }
@@ -0,0 +1,304 @@
+/*
+ MIT License (MIT)
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ */
+
+#ifndef LUA_LIBLWM2M_H_
+#define LUA_LIBLWM2M_H_
+
+#include "lua5.1/lua.h"
+
+#include "liblwm2m.h"
+#include <time.h>
+#include <sys/socket.h>
+
+// Maximum time (in seconds) between two lwm2m_step.
+#define LLWM_MAX_STEP_TIMEOUT 60
+// Maximum size of an UDP packet received by the native loop.
+#define LLWM_MAX_PACKET_SIZE 2048
+// Maximum number of events handled by one epoll_wait.
+#define LLWM_MAX_EVENTS 16
+// Number of buckets of the session hash table (must be a power of 2).
+#define LLWM_SESSION_BUCKETS 16
+// Maximum number of packets sent by one sendmmsg.
+#define LLWM_MAX_BATCH 64
+// Maximum number of packets read by one recvmmsg.
+#define LLWM_MAX_RECV_BATCH 16
+// Latency histograms count microseconds in log2 ranges, each one split in
+// 4 sub-buckets (values over ~1 minute are counted in the last bucket).
+#define LLWM_HISTO_SUB_BITS 2
+#define LLWM_HISTO_BUCKETS 100
+// Number of message ids of the last confirmable messages sent (to count retransmissions).
+#define LLWM_STATS_RECENT_MIDS 16
+// Maximum number of callbacks (kind and uri) followed by the profiler.
+#define LLWM_PROFILE_MAX_ENTRIES 4096
+// Id used in profiled uris for a missing instance or resource.
+#define LLWM_PROFILE_NO_ID 0xFFFF
+// Sizes of the records of the state store (see lua_store.c).
+#define LLWM_STORE_ENDPOINT_SIZE 64
+#define LLWM_STORE_LOCATION_SIZE 64
+#define LLWM_STORE_MAX_SERVERS 2
+#define LLWM_STORE_MAX_OBSERVATIONS 16
+
+struct llwm_fleet;
+
+// A packet queued in the send buffer of a context.
+typedef struct llwm_packet {
+	struct llwm_addr_t * session;
+	size_t offset;     // offset of the packet data in the send buffer
+	size_t length;
+} llwm_packet;
+
+// A packet held back by the send rate limiter (see llwm_ratelimit).
+typedef struct llwm_paced {
+	struct llwm_paced * next;
+	struct llwm_addr_t * session;
+	size_t length;
+	uint8_t data[];
+} llwm_paced;
+
+// Token bucket limiting the number of packets sent by second.
+typedef struct llwm_bucket {
+	double rate;       // tokens added by second (0 : no limit)
+	double burst;      // maximum number of tokens
+	double tokens;
+	int64_t last;      // monotonic time (in ms) of the last refill
+} llwm_bucket;
+
+// Notification attributes of a resource, as persisted by the state store.
+typedef struct llwm_attributes {
+	uint8_t flags;
+	int32_t pmin;
+	int32_t pmax;
+	double gt;
+	double lt;
+	double step;
+	uint8_t notified;
+	double lastValue;
+} llwm_attributes;
+
+// File mapped in memory keeping the state of contexts (see lua_store.c)
+typedef struct llwm_store {
+	int fd;
+	size_t size;
+	struct llwm_store_header * header; // NULL once closed
+} llwm_store;
+
+typedef struct llwm_addr_t {
+	struct llwm_addr_t * next; // next session in the same hash bucket
+	uint32_t hash;             // hash of the resolved address
+	char * host;
+	int port;
+	struct sockaddr_storage addr; // resolved address (addrLen is 0 if unresolved)
+	socklen_t addrLen;
+} llwm_addr_t;
+
+// View on bytes owned by the binding (see lua_buffer.c)
+typedef struct llwm_buffer {
+	const uint8_t * data; // NULL once the buffer is given back to the pool
+	size_t length;
+} llwm_buffer;
+
+// Operations timed by the statistics of a context.
+typedef enum {
+	LLWM_STAT_HANDLE,
+	LLWM_STAT_STEP,
+	LLWM_STAT_READ,
+	LLWM_STAT_WRITE,
+	LLWM_STAT_EXECUTE,
+	LLWM_STAT_CREATE,
+	LLWM_STAT_DELETE,
+	LLWM_STAT_COUNT
+} llwm_stat_kind;
+
+typedef struct llwm_histogram {
+	uint64_t count;
+	uint64_t sum;      // in microseconds
+	uint64_t max;
+	uint32_t buckets[LLWM_HISTO_BUCKETS];
+} llwm_histogram;
+
+// Statistics of a context (see lua_stats.c)
+typedef struct llwm_stats {
+	uint64_t received;        // packets handled
+	uint64_t dropped;         // packets dropped because no session matches their source
+	uint64_t sent;
+	uint64_t paced;           // packets held back by the send rate limiter
+	uint64_t sendErrors;
+	uint64_t retransmissions; // confirmable messages sent again
+	uint64_t unsaved;         // observations and servers which did not fit in the store record
+	uint64_t asyncErrors;     // async calls which ended in error after being resumed
+	uint64_t bytesReceived;
+	uint64_t bytesSent;
+	uint16_t recentMids[LLWM_STATS_RECENT_MIDS]; // ids of the last confirmable messages sent
+	int recentCount;
+	int recentNext;
+	llwm_histogram histograms[LLWM_STAT_COUNT];
+} llwm_stats;
+
+// Time spent in the callbacks of a uri (see lua_profiler.c)
+typedef struct llwm_profile_entry {
+	uint64_t key;      // kind, object id, instance id and resource id
+	uint64_t count;
+	uint64_t total;    // in microseconds
+	uint64_t max;
+} llwm_profile_entry;
+
+typedef struct llwm_profiler {
+	lua_State * L;
+	int enabled;
+	int64_t threshold;           // callbacks longer than this (in microseconds) are given to the hook
+	int hookRef;                 // Lua function called with slow callbacks
+	llwm_profile_entry * entries; // sorted by key
+	int nbEntries;
+	int capacity;
+	uint64_t missed;             // callbacks not counted because too many uris are followed
+} llwm_profiler;
+
+typedef struct llwm_userdata {
+	lua_State * L;
+	lwm2m_context_t * ctx;
+	int sendCallbackRef;
+	int connectServerCallbackRef;
+	int timerMode;     // if true, lwm2m_step is skipped while nextStep is not reached
+	int64_t nextStep;  // monotonic time (in ms) at which lwm2m_step should be called
+	int sock;          // UDP socket owned by the binding (-1 if packets go through Lua)
+	int epollfd;       // epoll instance used by the native loop
+	int running;       // true while the native loop is running
+	llwm_addr_t * sessions[LLWM_SESSION_BUCKETS]; // sessions indexed by address
+	struct llwm_fleet * fleet; // fleet this context belongs to (or NULL)
+	int fleetIndex;    // position in the fleet step scheduler
+	int fleetRef;      // reference on this userdata held by the fleet
+	int batchSend;     // if true, packets are queued and sent once by llwm_flush
+	int batchCallbackRef;      // Lua callback receiving the list of queued packets
+	llwm_packet * sendQueue;   // queued packets
+	int sendCount;
+	int sendCapacity;
+	uint8_t * sendBuffer;      // data of queued packets
+	size_t sendBufferLength;
+	size_t sendBufferCapacity;
+	lwm2m_uri_t * changed;     // uris changed since the last step (notified once by llwm_dostep)
+	int changedCount;
+	int changedCapacity;
+	int useBuffers;            // if true, packets are given to Lua callbacks as buffers
+	int bufferPoolRef;         // Lua table of buffers which can be reused
+	int buffersUsed;           // number of buffers of the pool given to Lua
+	llwm_stats stats;
+	llwm_profiler profiler;    // opt-in profiler of object callbacks
+	int64_t startAt;           // monotonic time (in ms) at which lwm2m_start is called (0 if started)
+	llwm_bucket bucket;        // send rate limiter of the context
+	llwm_paced * pacedHead;    // packets waiting for send tokens (FIFO)
+	llwm_paced * pacedTail;
+	llwm_store * store;        // store keeping the state of this context (or NULL)
+	int storeIndex;            // record of this context in the store
+	int storeRef;              // reference on the store held by the context
+	int resuming;              // true while lwm2m_start runs for a resumed context
+	int closing;               // true while close sends the last packets (send errors are not raised)
+	int storeDirty;            // true if the state may have changed since the last save
+	uint32_t storeServers;     // fingerprint of the server states at the last save
+	uint16_t resumed[LLWM_STORE_MAX_SERVERS]; // servers whose resumed registration is not confirmed
+	int nbResumed;
+} llwm_userdata;
+
+typedef struct llwm_fleet {
+	int epollfd;
+	int running;               // true while the fleet loop is running
+	llwm_userdata ** members;  // min-heap of contexts ordered by nextStep
+	int count;
+	int capacity;
+} llwm_fleet;
+
+// lua_liblwm2m.c
+time_t llwm_monotonic_time();
+int64_t llwm_monotonic_time_ms();
+int64_t llwm_monotonic_time_us();
+llwm_userdata * llwm_checkudata(lua_State * L, int index,
+		const char * functionname);
+int llwm_dostep(llwm_userdata * lwu, int64_t * timeoutP);
+void llwm_schedule_start(llwm_userdata * lwu, double delay);
+void llwm_receive(llwm_userdata * lwu);
+void llwm_flush(llwm_userdata * lwu);
+const char * llwm_state(llwm_userdata * lwu);
+
+// lua_fleet.c
+void llwm_fleet_reschedule(llwm_userdata * lwu);
+void llwm_fleet_remove(llwm_userdata * lwu);
+int64_t llwm_fleet_next_step(llwm_fleet * fleet);
+int llwm_fleet_poll(llwm_fleet * fleet, int64_t waitms);
+int llwm_fleet_new(lua_State * L);
+void llwm_fleet_register(lua_State * L);
+
+// lua_workers.c
+int llwm_workers_new(lua_State * L);
+void llwm_workers_register(lua_State * L);
+
+// lua_buffer.c
+void llwm_buffer_push(llwm_userdata * lwu, const uint8_t * data, size_t length);
+void llwm_buffer_release(llwm_userdata * lwu, int used);
+const uint8_t * llwm_todata(lua_State * L, int index, size_t * lengthP);
+void llwm_buffer_register(lua_State * L);
+
+// lua_stats.c
+void llwm_stats_record(llwm_stats * stats, llwm_stat_kind kind, int64_t start);
+void llwm_stats_sent(llwm_stats * stats, const uint8_t * buffer, size_t length);
+void llwm_stats_merge(llwm_stats * dst, const llwm_stats * src);
+void llwm_stats_push(lua_State * L, const llwm_stats * stats);
+const char * llwm_stats_kind_name(llwm_stat_kind kind);
+
+// lua_profiler.c
+void llwm_profile_init(llwm_profiler * profiler, lua_State * L);
+void llwm_profile_enable(llwm_profiler * profiler, int enable,
+		int64_t threshold, int hookRef);
+int64_t llwm_profile_start(llwm_profiler * profiler);
+void llwm_profile_record(llwm_profiler * profiler, llwm_stat_kind kind,
+		uint16_t objectId, uint16_t instanceId, uint16_t resourceId,
+		int64_t start);
+void llwm_profile_push_top(lua_State * L, llwm_profiler * profiler, int n);
+void llwm_profile_release(llwm_profiler * profiler);
+
+// lua_store.c
+int llwm_store_attach(llwm_userdata * lwu, llwm_store * store,
+		const char * endpoint);
+void llwm_store_start(llwm_userdata * lwu);
+int llwm_store_mutes(llwm_userdata * lwu, llwm_addr_t * la);
+void llwm_store_save(llwm_userdata * lwu);
+void llwm_store_forget(llwm_userdata * lwu);
+int llwm_store_new(lua_State * L);
+void llwm_store_register(lua_State * L);
+
+// lua_object.c
+lwm2m_object_t * get_lua_object(lua_State *L, int tableindex, int objId,
+		llwm_stats * stats, llwm_profiler * profiler);
+void free_lua_object(lwm2m_object_t * objectP);
+void redefine_lua_object(lwm2m_object_t * objectP);
+void reset_lua_objects(lwm2m_context_t * contextP);
+void invalidate_lua_objects(lwm2m_context_t * contextP, lwm2m_uri_t * uriP);
+int set_lua_object_value(lwm2m_context_t * contextP, uint16_t objId,
+		uint16_t instanceId, uint16_t resourceId, lua_State * L, int index);
+int set_lua_object_attributes(lwm2m_context_t * contextP, lwm2m_uri_t * uriP,
+		time_t now, lua_State * L, int index);
+int notify_lua_objects(lwm2m_context_t * contextP, time_t now, time_t * nextP);
+int get_lua_object_attributes(lwm2m_context_t * contextP, lwm2m_uri_t * uriP,
+		llwm_attributes * attrP);
+int restore_lua_object_attributes(lwm2m_context_t * contextP,
+		lwm2m_uri_t * uriP, const llwm_attributes * attrP, time_t now);
+int resume_lua_objects(lwm2m_context_t * contextP);
+
+#endif /* LUA_LIBLWM2M_H_ */
@@ -30,16 +30,140 @@
 #include "lua5.1/lauxlib.h"
 #include "lua5.1/lualib.h"
 
+#include "lua_liblwm2m.h"
+
+// Read values are carved from an arena and constants are given without a copy :
+// wakaama must know values it should not free.
+#ifndef LWM2M_TLV_FLAG_STATIC_DATA
+#error "liblwm2m does not define LWM2M_TLV_FLAG_STATIC_DATA, update the liblwm2m submodule"
+#endif
+
 #define LWM2M_STRING  0x01
 #define LWM2M_NUMBER  0x02
 #define LWM2M_BOOLEAN 0x03
 
+// Kinds of resource operation (see read, write and execute in lwm2mobject.lua)
+#define LUAOBJECT_OP_NONE     0 // operation not allowed
+#define LUAOBJECT_OP_CONSTANT 1 // read the constant value of the descriptor
+#define LUAOBJECT_OP_STORED   2 // read/write instance[resourceid] (default value is the constant)
+#define LUAOBJECT_OP_FUNCTION 3 // call op.read(instance), op.write(instance, value) or op.execute(instance)
+#define LUAOBJECT_OP_MODEFUNC 4 // call op(instance, mode[, value])
+#define LUAOBJECT_OP_STREAM   5 // call op.write(instance, chunk, offset, last) by chunk
+
+// Kinds of pending (asynchronous) calls
+#define LUAOBJECT_MODE_READ    1
+#define LUAOBJECT_MODE_WRITE   2
+#define LUAOBJECT_MODE_EXECUTE 3
+
+// Size of chunks of stream resources (same as CHUNK_SIZE in lwm2mobject.lua)
+#define LUAOBJECT_CHUNK_SIZE 1024
+
+// Initial size of the arena used for the values of read requests.
+#define LUAOBJECT_ARENA_SIZE 512
+
+// Compiled description of a resource of an object created by lwm2mobject.lua
+typedef struct luaobject_resource {
+	uint16_t id;
+	uint8_t type;        // LWM2M_STRING, LWM2M_NUMBER or LWM2M_BOOLEAN
+	uint8_t readOp;      // operation kinds, LUAOBJECT_OP_NONE if not allowed
+	uint8_t writeOp;
+	uint8_t executeOp;
+	uint8_t cache;       // read value can be cached (constant or "cache" field set)
+	uint8_t async;       // functions are run in coroutines ("async" field set)
+	uint8_t unavailable; // pending async reads without last value return 5.03 ("unavailable" field set)
+	int readRef;         // Lua functions references (LUA_NOREF if not a function)
+	int writeRef;
+	int executeRef;
+	int valueType;       // constant (or default) value : LUA_TNIL, LUA_TSTRING,
+	char * str;          // LUA_TNUMBER or LUA_TBOOLEAN
+	size_t strLen;
+	lua_Number number;
+} luaobject_resource;
+
+// Cached read value of a resource of an instance : the bytes of a string, or a
+// number which is encoded for each request (its encoding depends on the format).
+typedef struct luaobject_cached {
+	uint32_t key;        // instanceId << 16 | resourceId
+	uint8_t * value;     // string value (NULL if numeric)
+	size_t length;
+	uint8_t stored;      // value set by set_lua_object_value, used instead of Lua
+	uint8_t dirty;       // value changed since the last notify_lua_objects
+	uint8_t numeric;     // value is a number (or a boolean)
+	lua_Number number;
+} luaobject_cached;
+
+// Call of an async resource function waiting in its coroutine
+typedef struct luaobject_pending {
+	uint32_t key;        // instanceId << 16 | resourceId
+	uint8_t mode;        // LUAOBJECT_MODE_*
+	lua_State * co;
+	int threadRef;       // reference on the coroutine
+} luaobject_pending;
+
+// Notification attributes flags
+#define LUAOBJECT_ATTR_PMIN 0x01
+#define LUAOBJECT_ATTR_PMAX 0x02
+#define LUAOBJECT_ATTR_GT   0x04
+#define LUAOBJECT_ATTR_LT   0x08
+#define LUAOBJECT_ATTR_STEP 0x10
+
+// Notification attributes of a resource (see set_lua_object_attributes)
+typedef struct luaobject_attributes {
+	uint32_t key;        // instanceId << 16 | resourceId
+	uint8_t flags;       // LUAOBJECT_ATTR_* which are set
+	time_t pmin;
+	time_t pmax;
+	lua_Number gt;
+	lua_Number lt;
+	lua_Number step;
+	uint8_t notified;    // a notification was already sent
+	lua_Number lastValue; // stored value at the last notification
+	time_t lastTime;     // time of the last notification (or of attributes setting)
+} luaobject_attributes;
+
+// Cached type of a resource of a not compiled object
+typedef struct luaobject_type {
+	uint16_t id;
+	int type;
+} luaobject_type;
+
 typedef struct luaobject_userdata {
 	lua_State * L;
 	int tableref;
+	llwm_stats * stats;             // statistics of the context (or NULL)
+	llwm_profiler * profiler;       // callback profiler of the context (or NULL)
+	lwm2m_list_t ** nodes;          // nodes of objectP->instanceList, sorted by id
+	int nbNodes;
+	int nodesCapacity;
+	luaobject_resource * resources; // sorted by id, NULL if the object is not compiled
+	int nbResources;
+	luaobject_type * types;         // sorted by id, filled by prv_get_type
+	int nbTypes;
+	int typesCapacity;
+	uint16_t * resourceIds;         // result of list function, NULL if not yet called
+	int nbResourceIds;
+	uint8_t * arena;                // memory for values of read requests, released by reset_lua_objects
+	size_t arenaSize;
+	size_t arenaUsed;
+	size_t arenaMissed;             // bytes allocated on the heap because the arena was full
+	luaobject_cached * cached;      // sorted by key, values of cacheable resources
+	int nbCached;
+	int cachedCapacity;
+	int nbStored;                   // number of cached values which are stored values
+	uint32_t * dirty;               // keys of stored values changed since last notification
+	int nbDirty;
+	int dirtyCapacity;
+	luaobject_attributes * attributes; // notification attributes of resources
+	int nbAttributes;
+	luaobject_pending * pending;    // calls resumed by resume_lua_objects
+	int nbPending;
+	uint32_t * failed;              // keys of async reads which ended in error
+	int nbFailed;
+	int failedCapacity;
 } luaobject_userdata;
 
 // Push the instance with the given instanceId on the lua stack
+// (instances declared with a range are created by the __index of the object).
 static int prv_get_instance(lua_State * L, luaobject_userdata * userdata,
 		uint16_t instanceId) {
 	// Get table of this object on the stack.
@@ -50,8 +174,12 @@ static int prv_get_instance(lua_State * L, luaobject_userdata * userdata,
 	}
 
 	// Get instance
-	lua_pushinteger(L, instanceId); // stack: ..., object, instanceId
-	lua_gettable(L, -2); // stack: ..., object, instance
+	lua_rawgeti(L, -1, instanceId); // stack: ..., object, instance
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1); // stack: ..., object
+		lua_pushinteger(L, instanceId); // stack: ..., object, instanceId
+		lua_gettable(L, -2); // stack: ..., object, instance
+	}
 	if (!lua_istable(L, -1)) {
 		lua_pop(L, 2);
 		return 0;
@@ -63,10 +191,139 @@ static int prv_get_instance(lua_State * L, luaobject_userdata * userdata,
 	return 1;
 }
 
+// Search the node of the given instance in the instance list index,
+// return the index where it is (or should be inserted).
+static int prv_find_node(luaobject_userdata * userdata, uint16_t instanceId) {
+	int low = 0;
+	int high = userdata->nbNodes;
+	while (low < high) {
+		int mid = (low + high) / 2;
+		if (userdata->nodes[mid]->id < instanceId)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+// return true if the object has an instance with the given id.
+static int prv_has_instance(luaobject_userdata * userdata, uint16_t instanceId) {
+	int index = prv_find_node(userdata, instanceId);
+	return index < userdata->nbNodes
+			&& userdata->nodes[index]->id == instanceId;
+}
+
+// Add an instance in objectP->instanceList (the index gives its predecessor).
+// Finding the position is O(log n) but inserting in the index is a memmove, so
+// adding an instance is O(n).
+// return 0 if ok, -1 if memory can not be allocated.
+static int prv_add_node(lwm2m_object_t * objectP, uint16_t instanceId) {
+	luaobject_userdata * userdata = (luaobject_userdata *) objectP->userData;
+	int index = prv_find_node(userdata, instanceId);
+	if (index < userdata->nbNodes && userdata->nodes[index]->id == instanceId)
+		return 0;
+
+	if (userdata->nbNodes == userdata->nodesCapacity) {
+		int capacity = userdata->nodesCapacity ? userdata->nodesCapacity * 2 : 8;
+		lwm2m_list_t ** nodes = realloc(userdata->nodes,
+				capacity * sizeof(lwm2m_list_t *));
+		if (nodes == NULL)
+			return -1;
+		userdata->nodes = nodes;
+		userdata->nodesCapacity = capacity;
+	}
+	lwm2m_list_t * node = malloc(sizeof(lwm2m_list_t));
+	if (node == NULL)
+		return -1;
+	memset(node, 0, sizeof(lwm2m_list_t));
+	node->id = instanceId;
+
+	// Link it after its predecessor.
+	if (index == 0) {
+		node->next = objectP->instanceList;
+		objectP->instanceList = node;
+	} else {
+		node->next = userdata->nodes[index - 1]->next;
+		userdata->nodes[index - 1]->next = node;
+	}
+	memmove(&userdata->nodes[index + 1], &userdata->nodes[index],
+			(userdata->nbNodes - index) * sizeof(lwm2m_list_t *));
+	userdata->nodes[index] = node;
+	userdata->nbNodes++;
+	return 0;
+}
+
+// Remove an instance from objectP->instanceList.
+// return 0 if ok, -1 if there is no instance with this id.
+static int prv_remove_node(lwm2m_object_t * objectP, uint16_t instanceId) {
+	luaobject_userdata * userdata = (luaobject_userdata *) objectP->userData;
+	int index = prv_find_node(userdata, instanceId);
+	if (index >= userdata->nbNodes || userdata->nodes[index]->id != instanceId)
+		return -1;
+
+	// Unlink it from its predecessor.
+	lwm2m_list_t * node = userdata->nodes[index];
+	if (index == 0)
+		objectP->instanceList = node->next;
+	else
+		userdata->nodes[index - 1]->next = node->next;
+	free(node);
+
+	userdata->nbNodes--;
+	memmove(&userdata->nodes[index], &userdata->nodes[index + 1],
+			(userdata->nbNodes - index) * sizeof(lwm2m_list_t *));
+	return 0;
+}
+
+static int prv_compare_id(const void * a, const void * b) {
+	return *(const uint16_t *) a - *(const uint16_t *) b;
+}
+
+// Search the cached type of the given resource,
+// return the index where it is (or should be inserted) in the cache.
+static int prv_find_type(luaobject_userdata * userdata, uint16_t resourceid) {
+	int low = 0;
+	int high = userdata->nbTypes;
+	while (low < high) {
+		int mid = (low + high) / 2;
+		if (userdata->types[mid].id < resourceid)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+// Add the type of the given resource in the cache (at the index given by prv_find_type).
+static void prv_cache_type(luaobject_userdata * userdata, int index,
+		uint16_t resourceid, int type) {
+	if (userdata->nbTypes == userdata->typesCapacity) {
+		int capacity = userdata->typesCapacity ? userdata->typesCapacity * 2 : 8;
+		luaobject_type * types = realloc(userdata->types,
+				capacity * sizeof(luaobject_type));
+		if (types == NULL)
+			return; // no cache, type will be asked again next time.
+		userdata->types = types;
+		userdata->typesCapacity = capacity;
+	}
+	memmove(&userdata->types[index + 1], &userdata->types[index],
+			(userdata->nbTypes - index) * sizeof(luaobject_type));
+	userdata->types[index].id = resourceid;
+	userdata->types[index].type = type;
+	userdata->nbTypes++;
+}
+
 // get the type of the resource of with the given resourceid of
 // the instance on top of the stack
-static int prv_get_type(lua_State * L, uint16_t resourceid) {
-	// Call the list function
+// (types don't change, so they are cached until the object is redefined)
+static int prv_get_type(lua_State * L, luaobject_userdata * userdata,
+		uint16_t resourceid) {
+	// Search in cache
+	int index = prv_find_type(userdata, resourceid);
+	if (index < userdata->nbTypes && userdata->types[index].id == resourceid)
+		return userdata->types[index].type;
+
+	// Call the type function
 	lua_getfield(L, -1, "type"); // stack: ..., instance, typeFunc
 
 	// type field should be a function
@@ -88,11 +345,16 @@ static int prv_get_type(lua_State * L, uint16_t resourceid) {
 	int type = lua_tonumber(L,-1);
 	lua_pop(L, 1); // stack: ..., instance
 
+	prv_cache_type(userdata, index, resourceid, type);
 	return type;
 }
 
-// Push a lua list on the stack of all resourceId available for the instance on the stack
-static int prv_get_resourceId_list(lua_State * L) {
+// Get the list of all resourceId available for the instance on the stack
+// (the list function is called once, then the list is cached until the object is redefined)
+static int prv_get_resourceId_list(lua_State * L, luaobject_userdata * userdata) {
+	if (userdata->resourceIds != NULL)
+		return 1;
+
 	// Call the list function
 	lua_getfield(L, -1, "list"); // stack: ..., instance, listFunc
 
@@ -111,13 +373,71 @@ static int prv_get_resourceId_list(lua_State * L) {
 		return 0;
 	}
 
+	// Copy it in the cache
+	size_t nbRes = lua_objlen(L, -1);
+	uint16_t * resourceIds = malloc((nbRes + 1) * sizeof(uint16_t));
+	if (resourceIds == NULL) {
+		lua_pop(L, 1); // clean the stack
+		return 0;
+	}
+	int i = 0;
+	lua_pushnil(L); // stack: ..., instance, list, key(nil)
+	while (lua_next(L, -2) != 0) { // stack: ..., instance, list, key, value
+		if (lua_isnumber(L, -1) && i < nbRes)
+			resourceIds[i++] = lua_tonumber(L, -1);
+		// Removes 'value'; keeps 'key' for next iteration
+		lua_pop(L, 1); // stack: ..., instance, list, key
+	}
+	lua_pop(L, 1); // stack: ..., instance
+
+	userdata->resourceIds = resourceIds;
+	userdata->nbResourceIds = i;
 	return 1;
 }
 
+// Allocate memory for the value of a read request in the arena of the object.
+// return NULL if the value must be allocated on the heap (arena is full).
+static uint8_t * prv_arena_alloc(luaobject_userdata * userdata, size_t size) {
+	if (userdata->arenaUsed + size <= userdata->arenaSize) {
+		uint8_t * value = userdata->arena + userdata->arenaUsed;
+		userdata->arenaUsed += size;
+		return value;
+	}
+	userdata->arenaMissed += size;
+	return NULL;
+}
+
+// Set the string as value of dataP.
+// If isStatic, the string is not copied (it must live until the end of the request).
+// return 0 (COAP_NO_ERROR) if ok or COAP error if an error occurred (see liblwm2m.h)
+static int prv_set_string(luaobject_userdata * userdata, lwm2m_data_t * dataP,
+		const char * str, size_t length, int isStatic) {
+	dataP->length = length;
+	if (isStatic) {
+		dataP->value = (uint8_t *) str;
+		dataP->flags |= LWM2M_TLV_FLAG_STATIC_DATA;
+		return COAP_NO_ERROR ;
+	}
+	uint8_t * value = prv_arena_alloc(userdata, length + 1);
+	if (value != NULL) {
+		dataP->flags |= LWM2M_TLV_FLAG_STATIC_DATA;
+	} else {
+		value = malloc(length + 1);
+		if (value == NULL) {
+			// Manage memory allocation error
+			dataP->length = 0;
+			return COAP_500_INTERNAL_SERVER_ERROR ;
+		}
+	}
+	memcpy(value, str, length + 1);
+	dataP->value = value;
+	return COAP_NO_ERROR ;
+}
+
 // Convert the resource from the top of the stack in dataP
 // return 0 (COAP_NO_ERROR) if ok or COAP error if an error occurred (see liblwm2m.h)
-static int prv_luaToResourceData(lua_State * L, uint16_t resourceid,
-		lwm2m_data_t * dataP, lwm2m_data_type_t type) {
+static int prv_luaToResourceData(lua_State * L, luaobject_userdata * userdata,
+		uint16_t resourceid, lwm2m_data_t * dataP, lwm2m_data_type_t type) {
 	int value_type = lua_type(L, -1);
 	switch (value_type) {
 	case LUA_TNIL:
@@ -143,12 +463,13 @@ static int prv_luaToResourceData(lua_State * L, uint16_t resourceid,
 		break;
 	case LUA_TSTRING:
 		dataP->id = resourceid;
-		dataP->value = strdup(lua_tolstring(L, -1, &dataP->length));
 		dataP->type = type;
-		if (dataP->value == NULL) {
-			// Manage memory allocation error
-			return COAP_500_INTERNAL_SERVER_ERROR ;
-		}
+		size_t length;
+		const char * str = lua_tolstring(L, -1, &length);
+		// copy needed : the lua string could be collected before the value is sent.
+		int err = prv_set_string(userdata, dataP, str, length, 0);
+		if (err)
+			return err;
 		break;
 	case LUA_TTABLE:
 		if (type == LWM2M_TYPE_RESOURCE_INSTANCE)
@@ -172,7 +493,7 @@ static int prv_luaToResourceData(lua_State * L, uint16_t resourceid,
 			int i = 0;
 			while (lua_next(L, -2) != 0) { // stack: ...,resourceValue , key, value
 				if (lua_isnumber(L, -2)) {
-					int err = prv_luaToResourceData(L, lua_tonumber(L, -2),
+					int err = prv_luaToResourceData(L, userdata, lua_tonumber(L, -2),
 							&subdataP[i], LWM2M_TYPE_RESOURCE_INSTANCE);
 					i++;
 					if (err) {
@@ -199,9 +520,469 @@ static int prv_luaToResourceData(lua_State * L, uint16_t resourceid,
 	return COAP_NO_ERROR ;
 }
 
+// Find the descriptor of the given resource (binary search).
+static luaobject_resource * prv_find_resource(luaobject_userdata * userdata,
+		uint16_t resourceid) {
+	int low = 0;
+	int high = userdata->nbResources - 1;
+	while (low <= high) {
+		int middle = (low + high) / 2;
+		luaobject_resource * res = &userdata->resources[middle];
+		if (res->id == resourceid)
+			return res;
+		if (res->id < resourceid)
+			low = middle + 1;
+		else
+			high = middle - 1;
+	}
+	return NULL;
+}
+
+// Convert the constant value of the descriptor in dataP without calling Lua.
+// return 0 (COAP_NO_ERROR) if ok or COAP error if an error occurred (see liblwm2m.h)
+static int prv_constantToResourceData(luaobject_userdata * userdata,
+		luaobject_resource * res, lwm2m_data_t * dataP) {
+	dataP->id = res->id;
+	dataP->type = LWM2M_TYPE_RESOURCE;
+	switch (res->valueType) {
+	case LUA_TBOOLEAN:
+		lwm2m_data_encode_int(res->number != 0 ? 1 : 0, dataP);
+		break;
+	case LUA_TNUMBER:
+		lwm2m_data_encode_int((int64_t) res->number, dataP);
+		break;
+	case LUA_TSTRING:
+		// the constant lives as long as the descriptor : no copy needed.
+		return prv_set_string(userdata, dataP, res->str, res->strLen, 1);
+	default:
+		dataP->value = NULL;
+		dataP->length = 0;
+		break;
+	}
+	return COAP_NO_ERROR ;
+}
+
+// Search the cached value of the given resource,
+// return the index where it is (or should be inserted) in the cache.
+static int prv_find_cached(luaobject_userdata * userdata, uint32_t key) {
+	int low = 0;
+	int high = userdata->nbCached;
+	while (low < high) {
+		int mid = (low + high) / 2;
+		if (userdata->cached[mid].key < key)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+// Insert a new entry in the cache at the given index (see prv_find_cached).
+// return NULL if memory can not be allocated.
+static luaobject_cached * prv_insert_cached(luaobject_userdata * userdata,
+		uint32_t key, int index) {
+	if (userdata->nbCached == userdata->cachedCapacity) {
+		int capacity = userdata->cachedCapacity ? userdata->cachedCapacity * 2 : 8;
+		luaobject_cached * cached = realloc(userdata->cached,
+				capacity * sizeof(luaobject_cached));
+		if (cached == NULL)
+			return NULL;
+		userdata->cached = cached;
+		userdata->cachedCapacity = capacity;
+	}
+	memmove(&userdata->cached[index + 1], &userdata->cached[index],
+			(userdata->nbCached - index) * sizeof(luaobject_cached));
+	userdata->nbCached++;
+
+	luaobject_cached * c = &userdata->cached[index];
+	memset(c, 0, sizeof(luaobject_cached));
+	c->key = key;
+	return c;
+}
+
+// Keep a copy of the value of dataP for the next reads.
+// (the Lua value converted in dataP is on the top of the stack, only strings,
+// numbers and booleans are cached)
+static void prv_cache_data(lua_State * L, luaobject_userdata * userdata,
+		uint32_t key, int index, lwm2m_data_t * dataP) {
+	int type = lua_type(L, -1);
+	if (type != LUA_TSTRING && type != LUA_TNUMBER && type != LUA_TBOOLEAN)
+		return;
+	uint8_t * value = NULL;
+	if (type == LUA_TSTRING && dataP->length > 0) {
+		value = malloc(dataP->length);
+		if (value == NULL)
+			return; // not cached, value will be read again next time.
+		memcpy(value, dataP->value, dataP->length);
+	}
+
+	luaobject_cached * c = prv_insert_cached(userdata, key, index);
+	if (c == NULL) {
+		free(value);
+		return;
+	}
+	if (type == LUA_TSTRING) {
+		c->value = value;
+		c->length = dataP->length;
+	} else {
+		c->numeric = 1;
+		c->number = type == LUA_TNUMBER ?
+				lua_tonumber(L, -1) : lua_toboolean(L, -1);
+	}
+}
+
+// Set the cached value in dataP, flags set by wakaama for this request are kept.
+// Strings are copied : a Lua callback of the same request may change or uncache
+// the value while wakaama still uses it.
+// return 0 (COAP_NO_ERROR) if ok or COAP error if an error occurred (see liblwm2m.h)
+static int prv_cachedToResourceData(luaobject_userdata * userdata,
+		luaobject_cached * c, uint16_t resourceid, lwm2m_data_t * dataP) {
+	dataP->id = resourceid;
+	dataP->type = LWM2M_TYPE_RESOURCE;
+	if (c->numeric) {
+		lwm2m_data_encode_int((int64_t) c->number, dataP);
+		return COAP_NO_ERROR ;
+	}
+	dataP->length = c->length;
+	if (c->length == 0) {
+		dataP->value = NULL;
+		return COAP_NO_ERROR ;
+	}
+	uint8_t * value = prv_arena_alloc(userdata, c->length);
+	if (value != NULL) {
+		dataP->flags |= LWM2M_TLV_FLAG_STATIC_DATA;
+	} else {
+		value = malloc(c->length);
+		if (value == NULL)
+			return COAP_500_INTERNAL_SERVER_ERROR ;
+	}
+	memcpy(value, c->value, c->length);
+	dataP->value = value;
+	return COAP_NO_ERROR ;
+}
+
+// Remove the cached values between the 2 given keys,
+// stored values are removed only if withStored is set.
+static void prv_uncache_range(luaobject_userdata * userdata, uint32_t first,
+		uint32_t last, int withStored) {
+	int i = prv_find_cached(userdata, first);
+	int j = i;
+	for (; i < userdata->nbCached && userdata->cached[i].key <= last; i++) {
+		luaobject_cached * c = &userdata->cached[i];
+		if (c->stored && !withStored) {
+			userdata->cached[j++] = *c;
+			continue;
+		}
+		if (c->stored)
+			userdata->nbStored--;
+		free(c->value);
+	}
+	if (i == j)
+		return;
+	memmove(&userdata->cached[j], &userdata->cached[i],
+			(userdata->nbCached - i) * sizeof(luaobject_cached));
+	userdata->nbCached -= i - j;
+}
+
+// Remove the cached values of the given instance (all resources if resourceid is -1).
+static void prv_uncache(luaobject_userdata * userdata, uint16_t instanceId,
+		int resourceid, int withStored) {
+	uint32_t first = (uint32_t) instanceId << 16;
+	uint32_t last = first | 0xFFFF;
+	if (resourceid >= 0)
+		first = last = first | resourceid;
+	prv_uncache_range(userdata, first, last, withStored);
+}
+
+// Remove all cached values.
+static void prv_uncache_all(luaobject_userdata * userdata, int withStored) {
+	prv_uncache_range(userdata, 0, 0xFFFFFFFF, withStored);
+}
+
+// Serve the read from the stored value of the resource if any.
+// return 1 if the resource has a stored value, 0 else.
+static int prv_read_stored(luaobject_userdata * userdata, uint16_t instanceId,
+		uint16_t resourceid, lwm2m_data_t * dataP, uint8_t * resultP) {
+	if (userdata->nbStored == 0)
+		return 0;
+	uint32_t key = (uint32_t) instanceId << 16 | resourceid;
+	int index = prv_find_cached(userdata, key);
+	if (index >= userdata->nbCached || userdata->cached[index].key != key
+			|| !userdata->cached[index].stored)
+		return 0;
+	*resultP = prv_cachedToResourceData(userdata, &userdata->cached[index], resourceid,
+			dataP) ? COAP_500_INTERNAL_SERVER_ERROR : COAP_205_CONTENT;
+	return 1;
+}
+
+// Search a pending call of the given resource.
+static luaobject_pending * prv_find_pending(luaobject_userdata * userdata,
+		uint32_t key, uint8_t mode) {
+	int i;
+	for (i = 0; i < userdata->nbPending; i++) {
+		if (userdata->pending[i].key == key && userdata->pending[i].mode == mode)
+			return &userdata->pending[i];
+	}
+	return NULL;
+}
+
+// Call the function with its nargs arguments on the top of the stack.
+// Functions of async resources run in a coroutine : if it yields, the call
+// is pending and the coroutine is resumed at each step by resume_lua_objects.
+// return 0 if the call is done (with nresults results on the stack),
+// 1 if it is pending or -1 if it failed (nothing on the stack).
+static int prv_call(lua_State * L, luaobject_userdata * userdata,
+		luaobject_resource * res, uint32_t key, uint8_t mode, int nargs,
+		int nresults) {
+	if (!res->async) {
+		lua_call(L, nargs, nresults);
+		return 0;
+	}
+
+	// Run function in a new coroutine.
+	lua_State * co = lua_newthread(L); // stack: ..., func, args..., thread
+	lua_insert(L, -(nargs + 2)); // stack: ..., thread, func, args...
+	lua_xmove(L, co, nargs + 1); // stack: ..., thread
+	int status = lua_resume(co, nargs);
+
+	// Keep it until it ends.
+	if (status == LUA_YIELD) {
+		luaobject_pending * pending = realloc(userdata->pending,
+				(userdata->nbPending + 1) * sizeof(luaobject_pending));
+		if (pending == NULL) {
+			lua_pop(L, 1);
+			return -1;
+		}
+		userdata->pending = pending;
+		pending = &userdata->pending[userdata->nbPending++];
+		pending->key = key;
+		pending->mode = mode;
+		pending->co = co;
+		pending->threadRef = luaL_ref(L, LUA_REGISTRYINDEX); // stack: ...
+		return 1;
+	}
+	if (status != 0) {
+		// Raise the error as for synchronous functions.
+		lua_xmove(co, L, 1); // stack: ..., thread, error
+		lua_remove(L, -2); // stack: ..., error
+		lua_error(L);
+	}
+
+	// Done : move results.
+	lua_settop(co, nresults);
+	lua_xmove(co, L, nresults); // stack: ..., thread, results...
+	lua_remove(L, -(nresults + 1)); // stack: ..., results...
+	return 0;
+}
+
+// Resume the coroutine of the given pending read until it ends : reads of
+// resources without "unavailable" field wait for their value when there is no
+// last value to return.
+// The read value is pushed on the stack, an error of the read is raised (as for
+// synchronous functions).
+static void prv_wait_pending(lua_State * L, luaobject_userdata * userdata,
+		luaobject_pending * pendingP) {
+	luaobject_pending pending = *pendingP;
+	int status;
+	do {
+		status = lua_resume(pending.co, 0);
+	} while (status == LUA_YIELD);
+
+	// Forget it (pending array can be changed by the coroutine).
+	int i;
+	for (i = 0; i < userdata->nbPending; i++) {
+		if (userdata->pending[i].co == pending.co) {
+			userdata->pending[i] = userdata->pending[--userdata->nbPending];
+			break;
+		}
+	}
+	if (status == 0)
+		lua_settop(pending.co, 1);
+	lua_xmove(pending.co, L, 1); // stack: ..., value or error
+	luaL_unref(L, LUA_REGISTRYINDEX, pending.threadRef);
+	if (status != 0)
+		lua_error(L);
+}
+
+// Free the value of a data which is not given to wakaama.
+static void prv_free_value(lwm2m_data_t * dataP) {
+	if (dataP->flags & LWM2M_TLV_FLAG_STATIC_DATA)
+		return;
+	if (dataP->type == LWM2M_TYPE_MULTIPLE_RESOURCE)
+		lwm2m_data_free(dataP->length, (lwm2m_data_t *) dataP->value);
+	else
+		free(dataP->value);
+}
+
+// Search the given key in the keys of failed async reads,
+// return its index or -1.
+static int prv_find_failed(luaobject_userdata * userdata, uint32_t key) {
+	int i;
+	for (i = 0; i < userdata->nbFailed; i++) {
+		if (userdata->failed[i] == key)
+			return i;
+	}
+	return -1;
+}
+
+// Remember that the async read of the given resource ended in error : its last
+// value is forgotten and reads fail until a read succeeds.
+static void prv_set_failed(luaobject_userdata * userdata, uint32_t key) {
+	int index = prv_find_cached(userdata, key);
+	if (index < userdata->nbCached && userdata->cached[index].key == key
+			&& !userdata->cached[index].stored)
+		prv_uncache_range(userdata, key, key, 0);
+	if (prv_find_failed(userdata, key) >= 0)
+		return;
+	if (userdata->nbFailed == userdata->failedCapacity) {
+		int capacity = userdata->failedCapacity ?
+				userdata->failedCapacity * 2 : 4;
+		uint32_t * failed = realloc(userdata->failed,
+				capacity * sizeof(uint32_t));
+		if (failed == NULL)
+			return;
+		userdata->failed = failed;
+		userdata->failedCapacity = capacity;
+	}
+	userdata->failed[userdata->nbFailed++] = key;
+}
+
+// Read the last value of an async resource while its read is pending.
+static uint8_t prv_read_last(luaobject_userdata * userdata, uint32_t key,
+		uint16_t resourceid, lwm2m_data_t * dataP) {
+	if (prv_find_failed(userdata, key) >= 0)
+		return COAP_500_INTERNAL_SERVER_ERROR ;
+	int index = prv_find_cached(userdata, key);
+	if (index < userdata->nbCached && userdata->cached[index].key == key)
+		return prv_cachedToResourceData(userdata, &userdata->cached[index], resourceid,
+				dataP) ? COAP_500_INTERNAL_SERVER_ERROR : COAP_205_CONTENT;
+	return COAP_503_SERVICE_UNAVAILABLE ;
+}
+
+// Return true if a last value of the resource is kept (see prv_set_last).
+static int prv_has_last(luaobject_userdata * userdata, uint32_t key) {
+	int index = prv_find_cached(userdata, key);
+	return index < userdata->nbCached && userdata->cached[index].key == key;
+}
+
+// Keep the value read by an async resource, it is returned while the next read is pending.
+// (the Lua value converted in dataP is on the top of the stack)
+static void prv_set_last(lua_State * L, luaobject_userdata * userdata,
+		uint32_t key, lwm2m_data_t * dataP) {
+	int failed = prv_find_failed(userdata, key);
+	if (failed >= 0)
+		userdata->failed[failed] = userdata->failed[--userdata->nbFailed];
+	int index = prv_find_cached(userdata, key);
+	if (index < userdata->nbCached && userdata->cached[index].key == key) {
+		if (userdata->cached[index].stored)
+			return;
+		prv_uncache_range(userdata, key, key, 0);
+	}
+	if (dataP->type == LWM2M_TYPE_RESOURCE)
+		prv_cache_data(L, userdata, key, index, dataP);
+}
+
+// Read the resource of the instance on the top of the stack using its descriptor.
+static uint8_t prv_read_compiled_resource(lua_State * L,
+		luaobject_userdata * userdata, uint16_t instanceId,
+		luaobject_resource * res, lwm2m_data_t * dataP) {
+	int err;
+	uint8_t result;
+
+	// Use the stored or cached value if any.
+	if (prv_read_stored(userdata, instanceId, res->id, dataP, &result))
+		return result;
+	uint32_t key = (uint32_t) instanceId << 16 | res->id;
+	int index = 0;
+	if (res->cache) {
+		index = prv_find_cached(userdata, key);
+		if (index < userdata->nbCached && userdata->cached[index].key == key) {
+			return prv_cachedToResourceData(userdata, &userdata->cached[index], res->id,
+					dataP) ? COAP_500_INTERNAL_SERVER_ERROR : COAP_205_CONTENT;
+		}
+	}
+
+	switch (res->readOp) {
+	case LUAOBJECT_OP_CONSTANT:
+		err = prv_constantToResourceData(userdata, res, dataP);
+		return err ? err : COAP_205_CONTENT;
+	case LUAOBJECT_OP_STORED:
+		lua_pushinteger(L, res->id); // stack: ..., instance, resourceId
+		lua_rawget(L, -2); // stack: ..., instance, value
+		// (same as "instance[resourceid] or default" in lwm2mobject.lua)
+		if (!lua_toboolean(L, -1) && res->valueType != LUA_TNIL) {
+			lua_pop(L, 1); // stack: ..., instance
+			return prv_constantToResourceData(userdata, res, dataP) ?
+					COAP_500_INTERNAL_SERVER_ERROR : COAP_205_CONTENT;
+		}
+		break;
+	case LUAOBJECT_OP_FUNCTION:
+	case LUAOBJECT_OP_MODEFUNC:
+		// A previous read is not finished : use the last value, or wait for it.
+		if (res->async) {
+			luaobject_pending * pendingP = prv_find_pending(userdata, key,
+					LUAOBJECT_MODE_READ);
+			if (pendingP != NULL) {
+				if (res->unavailable || prv_has_last(userdata, key))
+					return prv_read_last(userdata, key, res->id, dataP);
+				prv_wait_pending(L, userdata, pendingP); // stack: ..., instance, value
+				break;
+			}
+		}
+
+		lua_rawgeti(L, LUA_REGISTRYINDEX, res->readRef); // stack: ..., instance, readFunc
+		lua_pushvalue(L, -2); // stack: ..., instance, readFunc, instance
+		int nargs = 1;
+		if (res->readOp == LUAOBJECT_OP_MODEFUNC) {
+			lua_pushstring(L, "read"); // stack: ..., instance, readFunc, instance, "read"
+			nargs++;
+		}
+		err = prv_call(L, userdata, res, key, LUAOBJECT_MODE_READ, nargs, 1); // stack: ..., instance, value
+		if (err < 0)
+			return COAP_500_INTERNAL_SERVER_ERROR ;
+		if (err > 0) {
+			if (res->unavailable || prv_has_last(userdata, key))
+				return prv_read_last(userdata, key, res->id, dataP);
+			prv_wait_pending(L, userdata,
+					prv_find_pending(userdata, key, LUAOBJECT_MODE_READ)); // stack: ..., instance, value
+		}
+		break;
+	default:
+		return COAP_405_METHOD_NOT_ALLOWED ;
+	}
+
+	err = prv_luaToResourceData(L, userdata, res->id, dataP,
+			LWM2M_TYPE_RESOURCE);
+	if (err) {
+		lua_pop(L, 1); // stack: ..., instance
+		return err;
+	}
+
+	// Keep the value for next reads (multiple resources are not cached)
+	if (res->async && !res->cache)
+		prv_set_last(L, userdata, key, dataP);
+	else if (res->cache && dataP->type == LWM2M_TYPE_RESOURCE)
+		prv_cache_data(L, userdata, key, index, dataP);
+	lua_pop(L, 1); // stack: ..., instance
+	return COAP_205_CONTENT;
+}
+
 // Read the resource of the instance on the top of the stack.
-static uint8_t prv_read_resource(lua_State * L, uint16_t resourceid,
-		lwm2m_data_t * dataP) {
+static uint8_t prv_read_resource(lua_State * L, luaobject_userdata * userdata,
+		uint16_t instanceId, uint16_t resourceid, lwm2m_data_t * dataP) {
+
+	// Use the descriptor of compiled objects.
+	if (userdata->resources != NULL) {
+		luaobject_resource * res = prv_find_resource(userdata, resourceid);
+		if (res == NULL)
+			return COAP_404_NOT_FOUND ;
+		return prv_read_compiled_resource(L, userdata, instanceId, res, dataP);
+	}
+
+	// Use the stored value if any.
+	uint8_t result;
+	if (prv_read_stored(userdata, instanceId, resourceid, dataP, &result))
+		return result;
 
 	// Get the read function
 	lua_getfield(L, -1, "read"); // stack: ..., instance, readFunc
@@ -218,7 +999,7 @@ static uint8_t prv_read_resource(lua_State * L, uint16_t resourceid,
 	// Get return code
 	int ret = lua_tointeger(L, -2);
 	if (ret == COAP_205_CONTENT) {
-		int err = prv_luaToResourceData(L, resourceid, dataP,
+		int err = prv_luaToResourceData(L, userdata, resourceid, dataP,
 		LWM2M_TYPE_RESOURCE);
 		if (err)
 			ret = err;
@@ -242,54 +1023,67 @@ static uint8_t prv_read(uint16_t instanceId, int * numDataP,
 		return COAP_404_NOT_FOUND ;
 
 	if ((*numDataP) == 0) {
-		// Push resourceId list on the stack
-		int res = prv_get_resourceId_list(L); // stack : ..., instance, resourceList
-		if (!res) {
+		// Get number of resource
+		int nbRes;
+		if (userdata->resources != NULL) {
+			nbRes = userdata->nbResources;
+		} else {
+			int res = prv_get_resourceId_list(L, userdata); // stack : ..., instance
+			if (!res) {
+				lua_pop(L, 1);
+				return COAP_500_INTERNAL_SERVER_ERROR ;
+			}
+			nbRes = userdata->nbResourceIds;
+		}
+
+		// Allocate memory for all resources
+		*dataArrayP = lwm2m_data_new(nbRes);
+		if (*dataArrayP == NULL) {
 			lua_pop(L, 1);
 			return COAP_500_INTERNAL_SERVER_ERROR ;
 		}
 
-		// Get number of resource
-		size_t nbRes = lua_objlen(L, -1);
-
-		// Create temporary structure
-		lwm2m_data_t tmpDataArray[nbRes];
-		memset(tmpDataArray, 0, nbRes * sizeof(lwm2m_data_t));
-
-		// Iterate through all items of the resourceId list
+		// Read resources directly in output parameter,
+		// resources which can not be read are overwritten by the next one.
 		int i = 0;
-		lua_pushnil(L); // stack: ..., instance, resourceList, key(nil)
-		while (lua_next(L, -2) != 0) { // stack: ...,instance , resourceList, key, value
-			if (lua_isnumber(L, -1)) {
-				int resourceid = lua_tonumber(L, -1);
-				lua_pushvalue(L, -4); // stack: ...,instance , resourceList, key, value, instance
-				int res = prv_read_resource(L, resourceid, &tmpDataArray[i]);
-				if (res <= COAP_205_CONTENT)
-					i++;
-				lua_pop(L, 1); // stack: ...,instance , resourceList, key, value
+		int j;
+		for (j = 0; j < nbRes; j++) {
+			lwm2m_data_t * dataP = (*dataArrayP) + i;
+			int res;
+			int64_t start = llwm_profile_start(userdata->profiler);
+			if (userdata->resources != NULL) {
+				if (userdata->resources[j].readOp == LUAOBJECT_OP_NONE)
+					continue;
+				res = prv_read_compiled_resource(L, userdata, instanceId,
+						&userdata->resources[j], dataP);
+			} else {
+				res = prv_read_resource(L, userdata, instanceId,
+						userdata->resourceIds[j], dataP);
 			}
-			// Removes 'value'; keeps 'key' for next iteration
-			lua_pop(L, 1); // stack: ...,instance , resourceList, key
+			llwm_profile_record(userdata->profiler, LLWM_STAT_READ,
+					objectP->objID, instanceId,
+					userdata->resources != NULL ?
+							userdata->resources[j].id : userdata->resourceIds[j],
+					start);
+			if (res <= COAP_205_CONTENT)
+				i++;
+			else
+				memset(dataP, 0, sizeof(lwm2m_data_t));
 		}
 		// Clean the stack
-		lua_pop(L, 2);
-
-		// Allocate memory for this resource
-		*dataArrayP = lwm2m_data_new(i);
-		if (*dataArrayP == NULL)
-			return COAP_500_INTERNAL_SERVER_ERROR ;
+		lua_pop(L, 1);
 
-		// Copy data in output parameter
 		(*numDataP) = i;
-		memcpy(*dataArrayP, tmpDataArray, sizeof(lwm2m_data_t) * i);
-
 		return COAP_205_CONTENT ;
 	} else {
 		// Get resource.
 		int ret;
 		int i = 0;
 		do{
-			ret = prv_read_resource(L, ((*dataArrayP)+i)->id, (*dataArrayP)+i);
+			int64_t start = llwm_profile_start(userdata->profiler);
+			ret = prv_read_resource(L, userdata, instanceId, ((*dataArrayP)+i)->id, (*dataArrayP)+i);
+			llwm_profile_record(userdata->profiler, LLWM_STAT_READ,
+					objectP->objID, instanceId, ((*dataArrayP)+i)->id, start);
 			i++;
 		}while (i < *numDataP && ret == COAP_205_CONTENT);
 		lua_pop(L, 1);
@@ -300,11 +1094,102 @@ static uint8_t prv_read(uint16_t instanceId, int * numDataP,
 	return COAP_501_NOT_IMPLEMENTED ;
 }
 
-// Read the resource of the instance on the top of the stack.
-static uint8_t prv_write_resource(lua_State * L, uint16_t resourceid,
-		lwm2m_data_t data) {
+// Decode the data and push its value on the stack.
+// return 0 (COAP_NO_ERROR) if ok or COAP error if value can not be decoded.
+static int prv_push_data(lua_State * L, lwm2m_data_t * data, int type) {
+	if (type == LWM2M_STRING) {
+		lua_pushlstring(L, (char *) data->value, data->length);
+		return COAP_NO_ERROR ;
+	}
+
+	int64_t val = 0;
+	if (lwm2m_data_decode_int(data, &val) != 1)
+		return COAP_400_BAD_REQUEST ; // unable to decode int
+	if (type == LWM2M_BOOLEAN)
+		lua_pushboolean(L, val);
+	else if (type == LWM2M_NUMBER)
+		lua_pushinteger(L, val);
+	else
+		return COAP_500_INTERNAL_SERVER_ERROR ;
+	return COAP_NO_ERROR ;
+}
+
+// Write the resource of the instance on the top of the stack using its descriptor.
+static uint8_t prv_write_compiled_resource(lua_State * L,
+		luaobject_userdata * userdata, uint16_t instanceId,
+		luaobject_resource * res, lwm2m_data_t * data) {
+	uint32_t key = (uint32_t) instanceId << 16 | res->id;
+	int err;
+	switch (res->writeOp) {
+	case LUAOBJECT_OP_STORED:
+		lua_pushinteger(L, res->id); // stack: ..., instance, resourceId
+		err = prv_push_data(L, data, res->type); // stack: ..., instance, resourceId, value
+		if (err) {
+			lua_pop(L, 1);
+			return err;
+		}
+		lua_rawset(L, -3); // stack: ..., instance
+		return COAP_204_CHANGED ;
+	case LUAOBJECT_OP_FUNCTION:
+		lua_rawgeti(L, LUA_REGISTRYINDEX, res->writeRef); // stack: ..., instance, writeFunc
+		lua_pushvalue(L, -2); // stack: ..., instance, writeFunc, instance
+		err = prv_push_data(L, data, res->type); // stack: ..., instance, writeFunc, instance, value
+		if (err) {
+			lua_pop(L, 2);
+			return err;
+		}
+		// (async write is acknowledged without waiting for the end of the coroutine)
+		if (prv_call(L, userdata, res, key, LUAOBJECT_MODE_WRITE, 2, 0) < 0) // stack: ..., instance
+			return COAP_500_INTERNAL_SERVER_ERROR ;
+		return COAP_204_CHANGED ;
+	case LUAOBJECT_OP_MODEFUNC:
+		lua_rawgeti(L, LUA_REGISTRYINDEX, res->writeRef); // stack: ..., instance, func
+		lua_pushvalue(L, -2); // stack: ..., instance, func, instance
+		lua_pushstring(L, "write"); // stack: ..., instance, func, instance, "write"
+		err = prv_push_data(L, data, res->type); // stack: ..., instance, func, instance, "write", value
+		if (err) {
+			lua_pop(L, 3);
+			return err;
+		}
+		if (prv_call(L, userdata, res, key, LUAOBJECT_MODE_WRITE, 3, 0) < 0) // stack: ..., instance
+			return COAP_500_INTERNAL_SERVER_ERROR ;
+		return COAP_204_CHANGED ;
+	case LUAOBJECT_OP_STREAM: {
+		// Give the value chunk by chunk, the last call has last set to true.
+		size_t offset = 0;
+		do {
+			size_t chunkLength = data->length - offset;
+			if (chunkLength > LUAOBJECT_CHUNK_SIZE)
+				chunkLength = LUAOBJECT_CHUNK_SIZE;
+			lua_rawgeti(L, LUA_REGISTRYINDEX, res->writeRef); // stack: ..., instance, writeFunc
+			lua_pushvalue(L, -2); // stack: ..., instance, writeFunc, instance
+			lua_pushlstring(L, (char *) data->value + offset, chunkLength); // stack: ..., instance, writeFunc, instance, chunk
+			lua_pushinteger(L, offset); // stack: ..., instance, writeFunc, instance, chunk, offset
+			offset += chunkLength;
+			lua_pushboolean(L, offset >= data->length); // stack: ..., instance, writeFunc, instance, chunk, offset, last
+			lua_call(L, 4, 0); // stack: ..., instance
+		} while (offset < data->length);
+		return COAP_204_CHANGED ;
+	}
+	default:
+		return COAP_405_METHOD_NOT_ALLOWED ;
+	}
+}
+
+// Write the resource of the instance on the top of the stack.
+static uint8_t prv_write_resource(lua_State * L, luaobject_userdata * userdata,
+		uint16_t instanceId, uint16_t resourceid, lwm2m_data_t data) {
+
+	// Use the descriptor of compiled objects.
+	if (userdata->resources != NULL) {
+		luaobject_resource * res = prv_find_resource(userdata, resourceid);
+		if (res == NULL)
+			return COAP_404_NOT_FOUND ;
+		return prv_write_compiled_resource(L, userdata, instanceId, res, &data);
+	}
+
 	// get resource type
-	int type = prv_get_type(L,resourceid);
+	int type = prv_get_type(L, userdata, resourceid);
 	// Get the write function
 	lua_getfield(L, -1, "write"); // stack: ..., instance, writeFunc
 	if (!lua_isfunction(L, -1)) {
@@ -358,18 +1243,50 @@ static uint8_t prv_write(uint16_t instanceId, int numData,
 	if (!res)
 		return COAP_500_INTERNAL_SERVER_ERROR ;
 
+	// Cached values of the instance could be changed by the write.
+	prv_uncache(userdata, instanceId, -1, 0);
+
 	// write resource
 	int i = 0;
 	int result;
 	do {
-		result = prv_write_resource(userdata->L, dataArray[i].id, dataArray[i]);
+		// Written value replaces the stored one.
+		prv_uncache(userdata, instanceId, dataArray[i].id, 1);
+		int64_t start = llwm_profile_start(userdata->profiler);
+		result = prv_write_resource(userdata->L, userdata, instanceId, dataArray[i].id,
+				dataArray[i]);
+		llwm_profile_record(userdata->profiler, LLWM_STAT_WRITE, objectP->objID,
+				instanceId, dataArray[i].id, start);
 		i++;
 	} while (i < numData && result == COAP_204_CHANGED );
 	lua_pop(L, 1);
 	return result;
 }
 
-static uint8_t prv_execute_resource(lua_State * L, uint16_t resourceid) {
+static uint8_t prv_execute_resource(lua_State * L, luaobject_userdata * userdata,
+		uint16_t instanceId, uint16_t resourceid) {
+	// Use the descriptor of compiled objects.
+	if (userdata->resources != NULL) {
+		luaobject_resource * res = prv_find_resource(userdata, resourceid);
+		if (res == NULL)
+			return COAP_404_NOT_FOUND ;
+		if (res->executeOp == LUAOBJECT_OP_NONE)
+			return COAP_405_METHOD_NOT_ALLOWED ;
+
+		lua_rawgeti(L, LUA_REGISTRYINDEX, res->executeRef); // stack: ..., instance, executeFunc
+		lua_pushvalue(L, -2); // stack: ..., instance, executeFunc, instance
+		int nargs = 1;
+		if (res->executeOp == LUAOBJECT_OP_MODEFUNC) {
+			lua_pushstring(L, "execute"); // stack: ..., instance, executeFunc, instance, "execute"
+			nargs++;
+		}
+		// (async execute is acknowledged without waiting for the end of the coroutine)
+		uint32_t key = (uint32_t) instanceId << 16 | resourceid;
+		if (prv_call(L, userdata, res, key, LUAOBJECT_MODE_EXECUTE, nargs, 0) < 0) // stack: ..., instance
+			return COAP_500_INTERNAL_SERVER_ERROR ;
+		return COAP_204_CHANGED ;
+	}
+
 	// Get the execute_function
 	lua_getfield(L, -1, "execute"); // stack: ..., instance, executeFunc
 	if (!lua_isfunction(L, -1)) {
@@ -403,7 +1320,7 @@ static uint8_t prv_execute(uint16_t instanceId, uint16_t resourceId,
 
 	// execute the given resource for the given id
 	if (instanceId == 0) {
-		int ret = prv_execute_resource(userdata->L, resourceId);
+		int ret = prv_execute_resource(userdata->L, userdata, instanceId, resourceId);
 		lua_pop(L, 1);
 		return ret;
 	} else {
@@ -417,18 +1334,16 @@ static uint8_t prv_execute(uint16_t instanceId, uint16_t resourceId,
 
 static uint8_t prv_delete(uint16_t id, lwm2m_object_t * objectP) {
 	// Remove instance in C list
-	lwm2m_list_t * deletedInstance;
-	objectP->instanceList = lwm2m_list_remove(objectP->instanceList, id,
-			(lwm2m_list_t **) &deletedInstance);
-	if (NULL == deletedInstance)
+	if (prv_remove_node(objectP, id) != 0)
 		return COAP_404_NOT_FOUND ;
 
-	free(deletedInstance);
-
 	// Get user data.
 	luaobject_userdata * userdata = (luaobject_userdata*) objectP->userData;
 	lua_State * L = userdata->L;
 
+	// Forget cached and stored values of the instance.
+	prv_uncache(userdata, id, -1, 1);
+
 	// Push instance on the stack
 	int res = prv_get_instance(L, userdata, id); // stack: ..., instance
 	if (!res)
@@ -437,7 +1352,7 @@ static uint8_t prv_delete(uint16_t id, lwm2m_object_t * objectP) {
 	// Get the delete function
 	lua_getfield(L, -1, "delete"); // stack: ..., instance, deleteFunc
 	if (!lua_isfunction(L, -1)) {
-		lua_pop(L, 1); // clean the stack
+		lua_pop(L, 2); // stack: ...
 		return COAP_500_INTERNAL_SERVER_ERROR ;
 	}
 
@@ -459,23 +1374,24 @@ static uint8_t prv_create(uint16_t instanceId, int numData,
 	luaobject_userdata * userdata = (luaobject_userdata*) objectP->userData;
 	lua_State * L = userdata->L;
 
+	// Forget cached values of a previous instance with the same id.
+	prv_uncache(userdata, instanceId, -1, 1);
+
 	// Get table of this object on the stack.
 	lua_rawgeti(L, LUA_REGISTRYINDEX, userdata->tableref); // stack: ..., object
 
 	// Get the create function
 	lua_getfield(L, -1, "create"); // stack: ..., object, createFunc
 	if (!lua_isfunction(L, -1)) {
-		lua_pop(L, 1); // clean the stack
+		lua_pop(L, 2); // stack: ...
 		return COAP_500_INTERNAL_SERVER_ERROR ;
 	}
 
 	// Create instance in C list
-	lwm2m_list_t * instance = malloc(sizeof(lwm2m_list_t));
-	if (NULL == instance)
+	if (prv_add_node(objectP, instanceId) != 0) {
+		lua_pop(L, 2); // stack: ...
 		return COAP_500_INTERNAL_SERVER_ERROR;
-	memset(instance, 0, sizeof(lwm2m_list_t));
-	instance->id = instanceId;
-	objectP->instanceList = LWM2M_LIST_ADD(objectP->instanceList, instance)
+	}
 
 	// Push object and instance id on the stack and call the create function
 	lua_pushvalue(L, -2);  // stack: ..., object, createFunc, object
@@ -484,6 +1400,7 @@ static uint8_t prv_create(uint16_t instanceId, int numData,
 
 	// Get return code
 	int ret = lua_tointeger(L, -2);
+	lua_pop(L, 3); // stack: ...
 	if (ret == COAP_201_CREATED) {
 		// write value
 		ret = prv_write(instanceId, numData, dataArray, objectP);
@@ -494,13 +1411,339 @@ static uint8_t prv_create(uint16_t instanceId, int numData,
 			return ret;
 		}
 	}
+	// Instance was not created : remove it from the C list.
+	prv_remove_node(objectP, instanceId);
+	return ret;
+}
+
+// Callbacks given to wakaama, timed in the statistics of the context.
+static uint8_t prv_timed_read(uint16_t instanceId, int * numDataP,
+		lwm2m_data_t ** dataArrayP, lwm2m_object_t * objectP) {
+	int64_t start = llwm_monotonic_time_us();
+	uint8_t ret = prv_read(instanceId, numDataP, dataArrayP, objectP);
+	llwm_stats_record(((luaobject_userdata*) objectP->userData)->stats,
+			LLWM_STAT_READ, start);
+	return ret;
+}
+
+static uint8_t prv_timed_write(uint16_t instanceId, int numData,
+		lwm2m_data_t * dataArray, lwm2m_object_t * objectP) {
+	int64_t start = llwm_monotonic_time_us();
+	uint8_t ret = prv_write(instanceId, numData, dataArray, objectP);
+	llwm_stats_record(((luaobject_userdata*) objectP->userData)->stats,
+			LLWM_STAT_WRITE, start);
+	return ret;
+}
+
+static uint8_t prv_timed_execute(uint16_t instanceId, uint16_t resourceId,
+		uint8_t * buffer, int length, lwm2m_object_t * objectP) {
+	luaobject_userdata * userdata = (luaobject_userdata*) objectP->userData;
+	int64_t start = llwm_monotonic_time_us();
+	int64_t profileStart = llwm_profile_start(userdata->profiler);
+	uint8_t ret = prv_execute(instanceId, resourceId, buffer, length, objectP);
+	llwm_profile_record(userdata->profiler, LLWM_STAT_EXECUTE, objectP->objID,
+			instanceId, resourceId, profileStart);
+	llwm_stats_record(userdata->stats, LLWM_STAT_EXECUTE, start);
+	return ret;
+}
+
+static uint8_t prv_timed_create(uint16_t instanceId, int numData,
+		lwm2m_data_t * dataArray, lwm2m_object_t * objectP) {
+	luaobject_userdata * userdata = (luaobject_userdata*) objectP->userData;
+	int64_t start = llwm_monotonic_time_us();
+	int64_t profileStart = llwm_profile_start(userdata->profiler);
+	uint8_t ret = prv_create(instanceId, numData, dataArray, objectP);
+	llwm_profile_record(userdata->profiler, LLWM_STAT_CREATE, objectP->objID,
+			instanceId, LLWM_PROFILE_NO_ID, profileStart);
+	llwm_stats_record(userdata->stats, LLWM_STAT_CREATE, start);
+	return ret;
+}
+
+static uint8_t prv_timed_delete(uint16_t id, lwm2m_object_t * objectP) {
+	luaobject_userdata * userdata = (luaobject_userdata*) objectP->userData;
+	int64_t start = llwm_monotonic_time_us();
+	int64_t profileStart = llwm_profile_start(userdata->profiler);
+	uint8_t ret = prv_delete(id, objectP);
+	llwm_profile_record(userdata->profiler, LLWM_STAT_DELETE, objectP->objID,
+			id, LLWM_PROFILE_NO_ID, profileStart);
+	llwm_stats_record(userdata->stats, LLWM_STAT_DELETE, start);
 	return ret;
 }
 
+// Get the type of the operation on the top of the stack (same rules as _type in lwm2mobject.lua)
+static uint8_t prv_compile_type(lua_State * L) {
+	const char * str;
+	uint8_t type;
+	switch (lua_type(L, -1)) {
+	case LUA_TTABLE:
+		// use the field type to know the type
+		lua_getfield(L, -1, "type"); // stack: ..., op, op.type
+		if (lua_type(L, -1) == LUA_TSTRING) {
+			str = lua_tostring(L, -1);
+			type = LWM2M_STRING;
+			if (strcmp(str, "number") == 0 || strcmp(str, "date") == 0)
+				type = LWM2M_NUMBER;
+			else if (strcmp(str, "boolean") == 0)
+				type = LWM2M_BOOLEAN;
+			lua_pop(L, 1); // stack: ..., op
+			return type;
+		}
+		lua_pop(L, 1); // stack: ..., op
+
+		// use the field write to know the type
+		lua_getfield(L, -1, "write"); // stack: ..., op, op.write
+		if (lua_type(L, -1) == LUA_TSTRING) {
+			str = lua_tostring(L, -1);
+			type = LWM2M_STRING;
+			if (strcmp(str, "number") == 0)
+				type = LWM2M_NUMBER;
+			else if (strcmp(str, "boolean") == 0)
+				type = LWM2M_BOOLEAN;
+			lua_pop(L, 1); // stack: ..., op
+			return type;
+		}
+		lua_pop(L, 1); // stack: ..., op
+
+		// use the type of read field
+		lua_getfield(L, -1, "read"); // stack: ..., op, op.read
+		type = LWM2M_STRING;
+		if (lua_type(L, -1) == LUA_TNUMBER)
+			type = LWM2M_NUMBER;
+		else if (lua_type(L, -1) == LUA_TBOOLEAN && lua_toboolean(L, -1))
+			type = LWM2M_BOOLEAN;
+		lua_pop(L, 1); // stack: ..., op
+		return type;
+	case LUA_TNUMBER:
+		return LWM2M_NUMBER;
+	case LUA_TBOOLEAN:
+		return LWM2M_BOOLEAN;
+	default:
+		// default type is "string"
+		return LWM2M_STRING;
+	}
+}
+
+// Store the value on the top of the stack as constant value of the descriptor.
+static void prv_compile_value(lua_State * L, luaobject_resource * res) {
+	const char * str;
+	res->valueType = lua_type(L, -1);
+	switch (res->valueType) {
+	case LUA_TSTRING:
+		str = lua_tolstring(L, -1, &res->strLen);
+		res->str = malloc(res->strLen + 1);
+		if (res->str == NULL) {
+			res->valueType = LUA_TNIL;
+			return;
+		}
+		memcpy(res->str, str, res->strLen + 1);
+		break;
+	case LUA_TNUMBER:
+		res->number = lua_tonumber(L, -1);
+		break;
+	case LUA_TBOOLEAN:
+		res->number = lua_toboolean(L, -1);
+		break;
+	default:
+		res->valueType = LUA_TNIL;
+		break;
+	}
+}
+
+// Compile the operation on the top of the stack in the descriptor
+// (same rules as read, write and execute in lwm2mobject.lua)
+static void prv_compile_resource(lua_State * L, luaobject_resource * res) {
+	res->readOp = res->writeOp = res->executeOp = LUAOBJECT_OP_NONE;
+	res->cache = 0;
+	res->async = 0;
+	res->unavailable = 0;
+	res->readRef = res->writeRef = res->executeRef = LUA_NOREF;
+	res->valueType = LUA_TNIL;
+	res->str = NULL;
+	res->strLen = 0;
+	res->number = 0;
+	res->type = prv_compile_type(L);
+
+	switch (lua_type(L, -1)) {
+	case LUA_TSTRING:
+	case LUA_TNUMBER:
+	case LUA_TBOOLEAN:
+		res->readOp = LUAOBJECT_OP_CONSTANT;
+		res->cache = 1;
+		prv_compile_value(L, res);
+		break;
+	case LUA_TFUNCTION:
+		res->readOp = res->writeOp = res->executeOp = LUAOBJECT_OP_MODEFUNC;
+		lua_pushvalue(L, -1);
+		res->readRef = luaL_ref(L, LUA_REGISTRYINDEX);
+		lua_pushvalue(L, -1);
+		res->writeRef = luaL_ref(L, LUA_REGISTRYINDEX);
+		lua_pushvalue(L, -1);
+		res->executeRef = luaL_ref(L, LUA_REGISTRYINDEX);
+		break;
+	case LUA_TTABLE:
+		lua_getfield(L, -1, "read"); // stack: ..., op, op.read
+		if (lua_isfunction(L, -1)) {
+			res->readOp = LUAOBJECT_OP_FUNCTION;
+			lua_pushvalue(L, -1);
+			res->readRef = luaL_ref(L, LUA_REGISTRYINDEX);
+		} else if (lua_isboolean(L, -1) && lua_toboolean(L, -1)) {
+			res->readOp = LUAOBJECT_OP_STORED;
+		} else if (lua_type(L, -1) == LUA_TSTRING
+				|| lua_type(L, -1) == LUA_TNUMBER) {
+			res->readOp = LUAOBJECT_OP_STORED;
+			prv_compile_value(L, res);
+		}
+		lua_pop(L, 1); // stack: ..., op
+
+		lua_getfield(L, -1, "write"); // stack: ..., op, op.write
+		if (lua_isfunction(L, -1)) {
+			res->writeOp = LUAOBJECT_OP_FUNCTION;
+			lua_pushvalue(L, -1);
+			res->writeRef = luaL_ref(L, LUA_REGISTRYINDEX);
+		} else if (lua_isboolean(L, -1) && lua_toboolean(L, -1)) {
+			res->writeOp = LUAOBJECT_OP_STORED;
+		}
+		lua_pop(L, 1); // stack: ..., op
+
+		// stream resources are written by chunk
+		lua_getfield(L, -1, "stream"); // stack: ..., op, op.stream
+		if (lua_toboolean(L, -1)) {
+			if (res->writeOp == LUAOBJECT_OP_FUNCTION)
+				res->writeOp = LUAOBJECT_OP_STREAM;
+		}
+		lua_pop(L, 1); // stack: ..., op
+
+		lua_getfield(L, -1, "async"); // stack: ..., op, op.async
+		res->async = lua_toboolean(L, -1);
+		lua_pop(L, 1); // stack: ..., op
+
+		lua_getfield(L, -1, "unavailable"); // stack: ..., op, op.unavailable
+		res->unavailable = res->async && lua_toboolean(L, -1);
+		lua_pop(L, 1); // stack: ..., op
+
+		lua_getfield(L, -1, "cache"); // stack: ..., op, op.cache
+		res->cache = res->readOp != LUAOBJECT_OP_NONE && lua_toboolean(L, -1);
+		lua_pop(L, 1); // stack: ..., op
+
+		lua_getfield(L, -1, "execute"); // stack: ..., op, op.execute
+		if (lua_isfunction(L, -1)) {
+			res->executeOp = LUAOBJECT_OP_FUNCTION;
+			lua_pushvalue(L, -1);
+			res->executeRef = luaL_ref(L, LUA_REGISTRYINDEX);
+		}
+		lua_pop(L, 1); // stack: ..., op
+		break;
+	}
+}
+
+static int prv_compare_resource(const void * a, const void * b) {
+	return ((const luaobject_resource *) a)->id
+			- ((const luaobject_resource *) b)->id;
+}
+
+// Compile the operations of the object table on the top of the stack, if it
+// was created by lwm2mobject.lua with the "native" field set.
+// return 1 if the object is compiled, else 0 (Lua functions of instances are used).
+static int prv_compile_object(lua_State * L, luaobject_userdata * userdata) {
+	userdata->resources = NULL;
+	userdata->nbResources = 0;
+
+	// Object should ask for it and have an operations table.
+	lua_getfield(L, -1, "native"); // stack: ..., object, native
+	int native = lua_toboolean(L, -1);
+	lua_pop(L, 1); // stack: ..., object
+	if (!native)
+		return 0;
+	lua_getfield(L, -1, "operations"); // stack: ..., object, operations
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		return 0;
+	}
+
+	// Count resources.
+	int size = 0;
+	lua_pushnil(L); // stack: ..., object, operations, nil
+	while (lua_next(L, -2) != 0) { // stack: ..., object, operations, key, value
+		if (lua_isnumber(L, -2))
+			size++;
+		lua_pop(L, 1); // stack: ..., object, operations, key
+	}
+	if (size == 0) {
+		lua_pop(L, 1);
+		return 0;
+	}
+
+	luaobject_resource * resources = malloc(size * sizeof(luaobject_resource));
+	if (resources == NULL) {
+		lua_pop(L, 1);
+		return 0;
+	}
+
+	// Compile each resource.
+	int i = 0;
+	lua_pushnil(L); // stack: ..., object, operations, nil
+	while (lua_next(L, -2) != 0) { // stack: ..., object, operations, key, value
+		if (lua_isnumber(L, -2)) {
+			resources[i].id = lua_tonumber(L, -2);
+			prv_compile_resource(L, &resources[i]);
+			i++;
+		}
+		lua_pop(L, 1); // stack: ..., object, operations, key
+	}
+	lua_pop(L, 1); // stack: ..., object
+
+	qsort(resources, size, sizeof(luaobject_resource), prv_compare_resource);
+	userdata->resources = resources;
+	userdata->nbResources = size;
+	return 1;
+}
+
+// Release the descriptors of a compiled object.
+static void prv_release_resources(lua_State * L, luaobject_userdata * userdata) {
+	int i;
+	for (i = 0; i < userdata->nbResources; i++) {
+		luaobject_resource * res = &userdata->resources[i];
+		luaL_unref(L, LUA_REGISTRYINDEX, res->readRef);
+		luaL_unref(L, LUA_REGISTRYINDEX, res->writeRef);
+		luaL_unref(L, LUA_REGISTRYINDEX, res->executeRef);
+		free(res->str);
+	}
+	free(userdata->resources);
+	userdata->resources = NULL;
+	userdata->nbResources = 0;
+}
+
+// Forget all cached information about the object definition.
+static void prv_release_definition(luaobject_userdata * userdata) {
+	prv_release_resources(userdata->L, userdata);
+	free(userdata->types);
+	userdata->types = NULL;
+	userdata->nbTypes = userdata->typesCapacity = 0;
+	free(userdata->resourceIds);
+	userdata->resourceIds = NULL;
+	userdata->nbResourceIds = 0;
+	prv_uncache_all(userdata, 0);
+}
+
 static void prv_close(lwm2m_object_t * objectP) {
 
 	luaobject_userdata * userdata = (luaobject_userdata *) objectP->userData;
 	if (userdata != NULL) {
+		// Release compiled resources and caches.
+		prv_release_definition(userdata);
+		prv_uncache_all(userdata, 1);
+		free(userdata->cached);
+		free(userdata->dirty);
+		free(userdata->attributes);
+		free(userdata->nodes);
+		int i;
+		for (i = 0; i < userdata->nbPending; i++)
+			luaL_unref(userdata->L, LUA_REGISTRYINDEX,
+					userdata->pending[i].threadRef);
+		free(userdata->pending);
+		free(userdata->failed);
+		free(userdata->arena);
+
 		// Release table reference in lua registry.
 		if (userdata->tableref != LUA_NOREF) {
 			luaL_unref(userdata->L, LUA_REGISTRYINDEX, userdata->tableref);
@@ -513,7 +1756,20 @@ static void prv_close(lwm2m_object_t * objectP) {
 	}
 }
 
-lwm2m_object_t * get_lua_object(lua_State *L, int tableindex, int objId) {
+// Release an object built by get_lua_object which is not given to wakaama :
+// its userdata (as prv_close does), its instance list and the object itself.
+void free_lua_object(lwm2m_object_t * objectP) {
+	prv_close(objectP);
+	while (objectP->instanceList != NULL) {
+		lwm2m_list_t * nodeP = objectP->instanceList;
+		objectP->instanceList = nodeP->next;
+		free(nodeP);
+	}
+	free(objectP);
+}
+
+lwm2m_object_t * get_lua_object(lua_State *L, int tableindex, int objId,
+		llwm_stats * stats, llwm_profiler * profiler) {
 
 	// Allocate memory for lwm2m object.
 	lwm2m_object_t * objectP = (lwm2m_object_t *) malloc(
@@ -536,12 +1792,36 @@ lwm2m_object_t * get_lua_object(lua_State *L, int tableindex, int objId) {
 
 		// set fields
 		userdata->L = L;
+		userdata->stats = stats;
+		userdata->profiler = profiler;
+		userdata->types = NULL;
+		userdata->nbTypes = userdata->typesCapacity = 0;
+		userdata->resourceIds = NULL;
+		userdata->nbResourceIds = 0;
+		userdata->cached = NULL;
+		userdata->nbCached = userdata->cachedCapacity = 0;
+		userdata->nbStored = 0;
+		userdata->dirty = NULL;
+		userdata->nbDirty = userdata->dirtyCapacity = 0;
+		userdata->attributes = NULL;
+		userdata->nbAttributes = 0;
+		userdata->pending = NULL;
+		userdata->nbPending = 0;
+		userdata->failed = NULL;
+		userdata->nbFailed = userdata->failedCapacity = 0;
+		userdata->nodes = NULL;
+		userdata->nbNodes = userdata->nodesCapacity = 0;
+		userdata->arena = NULL;
+		userdata->arenaSize = userdata->arenaUsed = userdata->arenaMissed = 0;
+		userdata->arena = malloc(LUAOBJECT_ARENA_SIZE);
+		if (userdata->arena != NULL)
+			userdata->arenaSize = LUAOBJECT_ARENA_SIZE;
 		objectP->objID = objId;
-		objectP->readFunc = prv_read;
-		objectP->writeFunc = prv_write;
-		objectP->executeFunc = prv_execute;
-		objectP->createFunc = prv_create;
-		objectP->deleteFunc = prv_delete;
+		objectP->readFunc = prv_timed_read;
+		objectP->writeFunc = prv_timed_write;
+		objectP->executeFunc = prv_timed_execute;
+		objectP->createFunc = prv_timed_create;
+		objectP->deleteFunc = prv_timed_delete;
 		objectP->closeFunc = prv_close;
 		objectP->userData = userdata;
 
@@ -549,26 +1829,599 @@ lwm2m_object_t * get_lua_object(lua_State *L, int tableindex, int objId) {
 		// ---------------------
 		// Get table of this object on the stack.
 		lua_rawgeti(L, LUA_REGISTRYINDEX, userdata->tableref); // stack: ..., objectTable
-		int i = 0;
+
+		// Compile resource operations (objects from lwm2mobject.lua)
+		prv_compile_object(L, userdata); // stack: ..., objectTable
+
+		// Instances declared by range are created in Lua at first access.
+		int first = 0;
+		int last = -1;
+		lua_pushstring(L, "range"); // stack: ..., objectTable, "range"
+		lua_rawget(L, -2); // stack: ..., objectTable, range
+		if (lua_istable(L, -1)) {
+			lua_rawgeti(L, -1, 1); // stack: ..., objectTable, range, first
+			lua_rawgeti(L, -2, 2); // stack: ..., objectTable, range, first, last
+			first = lua_tointeger(L, -2);
+			last = lua_tointeger(L, -1);
+			lua_pop(L, 2); // stack: ..., objectTable, range
+			if (first < 0)
+				first = 0;
+			if (last > 0xFFFF)
+				last = 0xFFFF;
+		}
+		lua_pop(L, 1); // stack: ..., objectTable
+
+		// Collect instance ids.
+		size_t size = last >= first ? last - first + 1 : 0;
 		lua_pushnil(L); // stack: ..., objectTable, key(nil)
 		while (lua_next(L, -2) != 0) { // stack: ..., objectTable, key, value
-			if (lua_isnumber(L, -2)) {
-				int instanceid = lua_tonumber(L, -2);
-				lwm2m_list_t * instance = malloc(sizeof(lwm2m_list_t));
-				if (NULL == instance)
-					return NULL;
-				memset(instance, 0, sizeof(lwm2m_list_t));
-				instance->id = instanceid;
-				objectP->instanceList = LWM2M_LIST_ADD(objectP->instanceList,
-						instance);
-			}
+			if (lua_isnumber(L, -2))
+				size++;
+			// Removes 'value'; keeps 'key' for next iteration
+			lua_pop(L, 1); // stack: ..., objectTable, key
+		}
+		uint16_t * ids = malloc((size + 1) * sizeof(uint16_t));
+		if (ids == NULL) {
+			lua_pop(L, 1);
+			free_lua_object(objectP);
+			return NULL;
+		}
+		size_t nbIds = 0;
+		int id;
+		for (id = first; id <= last; id++)
+			ids[nbIds++] = id;
+		lua_pushnil(L); // stack: ..., objectTable, key(nil)
+		while (lua_next(L, -2) != 0) { // stack: ..., objectTable, key, value
+			if (lua_isnumber(L, -2) && nbIds < size)
+				ids[nbIds++] = lua_tonumber(L, -2);
 			// Removes 'value'; keeps 'key' for next iteration
 			lua_pop(L, 1); // stack: ..., objectTable, key
 		}
 		// Clean the stack
 		lua_pop(L, 1);
 
+		// Build the instance list at once, in id order.
+		qsort(ids, nbIds, sizeof(uint16_t), prv_compare_id);
+		userdata->nodes = malloc((nbIds + 1) * sizeof(lwm2m_list_t *));
+		if (userdata->nodes == NULL) {
+			free(ids);
+			free_lua_object(objectP);
+			return NULL;
+		}
+		userdata->nodesCapacity = nbIds + 1;
+		lwm2m_list_t ** tail = &objectP->instanceList;
+		size_t i;
+		for (i = 0; i < nbIds; i++) {
+			if (i > 0 && ids[i] == ids[i - 1])
+				continue;
+			lwm2m_list_t * node = malloc(sizeof(lwm2m_list_t));
+			if (node == NULL) {
+				free(ids);
+				free_lua_object(objectP);
+				return NULL;
+			}
+			memset(node, 0, sizeof(lwm2m_list_t));
+			node->id = ids[i];
+			*tail = node;
+			tail = &node->next;
+			userdata->nodes[userdata->nbNodes++] = node;
+		}
+		free(ids);
+
 	}
 
 	return objectP;
 }
+
+// Reload the definition of a lua object (after its operations changed).
+void redefine_lua_object(lwm2m_object_t * objectP) {
+	luaobject_userdata * userdata = (luaobject_userdata *) objectP->userData;
+	if (userdata == NULL)
+		return;
+	lua_State * L = userdata->L;
+
+	// Forget the previous definition.
+	prv_release_definition(userdata);
+
+	// Compile it again.
+	lua_rawgeti(L, LUA_REGISTRYINDEX, userdata->tableref); // stack: ..., objectTable
+	prv_compile_object(L, userdata); // stack: ..., objectTable
+	lua_pop(L, 1); // stack: ...
+}
+
+// Release values of read requests of all lua objects of the context.
+// Must be called once wakaama has sent the response of the requests.
+void reset_lua_objects(lwm2m_context_t * contextP) {
+	int i;
+	for (i = 0; i < contextP->numObject; i++) {
+		lwm2m_object_t * objectP = contextP->objectList[i];
+		if (objectP->closeFunc != prv_close || objectP->userData == NULL)
+			continue;
+		luaobject_userdata * userdata = (luaobject_userdata *) objectP->userData;
+
+		// Grow the arena if it was too small for the last requests.
+		if (userdata->arenaMissed > 0) {
+			size_t size = userdata->arenaSize + userdata->arenaMissed;
+			uint8_t * arena = realloc(userdata->arena, size);
+			if (arena != NULL) {
+				userdata->arena = arena;
+				userdata->arenaSize = size;
+			}
+			userdata->arenaMissed = 0;
+		}
+		userdata->arenaUsed = 0;
+	}
+}
+
+// Forget cached values of the resources targeted by the given uri.
+void invalidate_lua_objects(lwm2m_context_t * contextP, lwm2m_uri_t * uriP) {
+	int i;
+	for (i = 0; i < contextP->numObject; i++) {
+		lwm2m_object_t * objectP = contextP->objectList[i];
+		if (objectP->closeFunc != prv_close || objectP->userData == NULL
+				|| objectP->objID != uriP->objectId)
+			continue;
+		luaobject_userdata * userdata = (luaobject_userdata *) objectP->userData;
+
+		if (!(uriP->flag & LWM2M_URI_FLAG_INSTANCE_ID))
+			prv_uncache_all(userdata, 0);
+		else if (!(uriP->flag & LWM2M_URI_FLAG_RESOURCE_ID))
+			prv_uncache(userdata, uriP->instanceId, -1, 0);
+		else
+			prv_uncache(userdata, uriP->instanceId, uriP->resourceId, 0);
+	}
+}
+
+// Search the lua object with the given id in the context.
+static lwm2m_object_t * prv_find_lua_object(lwm2m_context_t * contextP,
+		uint16_t objId) {
+	int i;
+	for (i = 0; i < contextP->numObject; i++) {
+		lwm2m_object_t * objectP = contextP->objectList[i];
+		if (objectP->objID == objId && objectP->closeFunc == prv_close
+				&& objectP->userData != NULL)
+			return objectP;
+	}
+	return NULL;
+}
+
+// Store the value at the given index of the stack as value of the resource,
+// reads of this resource are then served without calling Lua.
+// return 1 if the value changed, 0 if it did not, or -1 with an error message
+// pushed on the stack.
+int set_lua_object_value(lwm2m_context_t * contextP, uint16_t objId,
+		uint16_t instanceId, uint16_t resourceId, lua_State * L, int index) {
+	// Search resource.
+	lwm2m_object_t * objectP = prv_find_lua_object(contextP, objId);
+	if (objectP == NULL) {
+		lua_pushstring(L, "object not found");
+		return -1;
+	}
+	luaobject_userdata * userdata = (luaobject_userdata *) objectP->userData;
+	if (!prv_has_instance(userdata, instanceId)) {
+		lua_pushstring(L, "instance not found");
+		return -1;
+	}
+	luaobject_resource * res = NULL;
+	if (userdata->resources != NULL) {
+		res = prv_find_resource(userdata, resourceId);
+		if (res == NULL) {
+			lua_pushstring(L, "resource not found");
+			return -1;
+		}
+	}
+
+	// Check the value against the type of the resource, a number is
+	// converted for a string resource.
+	if (index < 0)
+		index = lua_gettop(L) + index + 1;
+	if (res != NULL) {
+		int valueType = lua_type(L, index);
+		if (res->type == LWM2M_STRING && valueType == LUA_TNUMBER) {
+			lua_pushstring(L, lua_tostring(L, index));
+			lua_replace(L, index);
+		} else if ((res->type == LWM2M_STRING && valueType != LUA_TSTRING)
+				|| (res->type == LWM2M_NUMBER && valueType != LUA_TNUMBER)
+				|| (res->type == LWM2M_BOOLEAN && valueType != LUA_TBOOLEAN)) {
+			lua_pushfstring(L, "value of resource %d should be a %s",
+					resourceId,
+					res->type == LWM2M_STRING ? "string" :
+					res->type == LWM2M_NUMBER ? "number" : "boolean");
+			return -1;
+		}
+	}
+
+	// Get value (numbers are encoded for each request).
+	const char * str = NULL;
+	size_t length = 0;
+	lua_Number number = 0;
+	switch (lua_type(L, index)) {
+	case LUA_TSTRING:
+		str = lua_tolstring(L, index, &length);
+		break;
+	case LUA_TNUMBER:
+		number = lua_tonumber(L, index);
+		break;
+	case LUA_TBOOLEAN:
+		number = lua_toboolean(L, index) ? 1 : 0;
+		break;
+	default:
+		lua_pushstring(L, "value should be a string, a number or a boolean");
+		return -1;
+	}
+	int numeric = str == NULL;
+
+	// Compare with the previous value.
+	uint32_t key = (uint32_t) instanceId << 16 | resourceId;
+	int i = prv_find_cached(userdata, key);
+	luaobject_cached * c = NULL;
+	if (i < userdata->nbCached && userdata->cached[i].key == key) {
+		c = &userdata->cached[i];
+		if (c->stored && c->numeric == numeric
+				&& (numeric ? c->number == number :
+						c->length == length
+								&& (length == 0
+										|| memcmp(c->value, str, length) == 0)))
+			return 0;
+	}
+
+	// Copy the value.
+	uint8_t * value = NULL;
+	if (length > 0) {
+		value = malloc(length);
+		if (value != NULL)
+			memcpy(value, str, length);
+	}
+	if (value == NULL && length > 0) {
+		lua_pushstring(L, "memory allocation error");
+		return -1;
+	}
+
+	// Make room in the dirty list first : once replaced, the value must be notified.
+	if ((c == NULL || !c->dirty) && userdata->nbDirty == userdata->dirtyCapacity) {
+		int capacity = userdata->dirtyCapacity ? userdata->dirtyCapacity * 2 : 8;
+		uint32_t * dirty = realloc(userdata->dirty, capacity * sizeof(uint32_t));
+		if (dirty == NULL) {
+			free(value);
+			lua_pushstring(L, "memory allocation error");
+			return -1;
+		}
+		userdata->dirty = dirty;
+		userdata->dirtyCapacity = capacity;
+	}
+
+	// Replace the previous value.
+	if (c == NULL) {
+		c = prv_insert_cached(userdata, key, i);
+		if (c == NULL) {
+			free(value);
+			lua_pushstring(L, "memory allocation error");
+			return -1;
+		}
+	}
+	free(c->value);
+	if (!c->stored)
+		userdata->nbStored++;
+	c->stored = 1;
+	c->value = value;
+	c->length = length;
+	c->numeric = numeric;
+	c->number = number;
+
+	// Mark it dirty, observers will be notified by notify_lua_objects.
+	if (!c->dirty) {
+		userdata->dirty[userdata->nbDirty++] = key;
+		c->dirty = 1;
+	}
+	return 1;
+}
+
+// Search the notification attributes of the given resource.
+static luaobject_attributes * prv_find_attributes(luaobject_userdata * userdata,
+		uint32_t key) {
+	int i;
+	for (i = 0; i < userdata->nbAttributes; i++) {
+		if (userdata->attributes[i].key == key)
+			return &userdata->attributes[i];
+	}
+	return NULL;
+}
+
+// Set the notification attributes of a resource from the table at the given
+// index of the stack (fields pmin, pmax, gt, lt and step), nil removes them.
+// return 0 if ok, or -1 with an error message pushed on the stack.
+int set_lua_object_attributes(lwm2m_context_t * contextP, lwm2m_uri_t * uriP,
+		time_t now, lua_State * L, int index) {
+	// Search resource.
+	if (!(uriP->flag & LWM2M_URI_FLAG_RESOURCE_ID)) {
+		lua_pushstring(L, "attributes can only be set on resources");
+		return -1;
+	}
+	lwm2m_object_t * objectP = prv_find_lua_object(contextP, uriP->objectId);
+	if (objectP == NULL) {
+		lua_pushstring(L, "object not found");
+		return -1;
+	}
+	luaobject_userdata * userdata = (luaobject_userdata *) objectP->userData;
+	uint32_t key = (uint32_t) uriP->instanceId << 16 | uriP->resourceId;
+	luaobject_attributes * a = prv_find_attributes(userdata, key);
+
+	// Remove attributes.
+	if (lua_isnoneornil(L, index)) {
+		if (a != NULL)
+			*a = userdata->attributes[--userdata->nbAttributes];
+		return 0;
+	}
+	if (!lua_istable(L, index)) {
+		lua_pushstring(L, "attributes should be a table");
+		return -1;
+	}
+
+	// Add attributes.
+	if (a == NULL) {
+		a = realloc(userdata->attributes,
+				(userdata->nbAttributes + 1) * sizeof(luaobject_attributes));
+		if (a == NULL) {
+			lua_pushstring(L, "memory allocation error");
+			return -1;
+		}
+		userdata->attributes = a;
+		a = &userdata->attributes[userdata->nbAttributes++];
+		memset(a, 0, sizeof(luaobject_attributes));
+		a->key = key;
+		a->lastTime = now;
+	}
+
+	// Read attributes.
+	a->flags = 0;
+	lua_getfield(L, index, "pmin");
+	if (lua_isnumber(L, -1)) {
+		a->flags |= LUAOBJECT_ATTR_PMIN;
+		a->pmin = lua_tonumber(L, -1);
+	}
+	lua_getfield(L, index, "pmax");
+	if (lua_isnumber(L, -1)) {
+		a->flags |= LUAOBJECT_ATTR_PMAX;
+		a->pmax = lua_tonumber(L, -1);
+	}
+	lua_getfield(L, index, "gt");
+	if (lua_isnumber(L, -1)) {
+		a->flags |= LUAOBJECT_ATTR_GT;
+		a->gt = lua_tonumber(L, -1);
+	}
+	lua_getfield(L, index, "lt");
+	if (lua_isnumber(L, -1)) {
+		a->flags |= LUAOBJECT_ATTR_LT;
+		a->lt = lua_tonumber(L, -1);
+	}
+	lua_getfield(L, index, "step");
+	if (lua_isnumber(L, -1)) {
+		a->flags |= LUAOBJECT_ATTR_STEP;
+		a->step = lua_tonumber(L, -1);
+	}
+	lua_pop(L, 5);
+	return 0;
+}
+
+// Get the notification attributes of a resource (see lua_store.c),
+// return 0 if the resource has no attributes.
+int get_lua_object_attributes(lwm2m_context_t * contextP, lwm2m_uri_t * uriP,
+		llwm_attributes * attrP) {
+	if (!(uriP->flag & LWM2M_URI_FLAG_RESOURCE_ID))
+		return 0;
+	lwm2m_object_t * objectP = prv_find_lua_object(contextP, uriP->objectId);
+	if (objectP == NULL)
+		return 0;
+	luaobject_userdata * userdata = (luaobject_userdata *) objectP->userData;
+	luaobject_attributes * a = prv_find_attributes(userdata,
+			(uint32_t) uriP->instanceId << 16 | uriP->resourceId);
+	if (a == NULL)
+		return 0;
+
+	memset(attrP, 0, sizeof(llwm_attributes));
+	attrP->flags = a->flags;
+	attrP->pmin = a->pmin;
+	attrP->pmax = a->pmax;
+	attrP->gt = a->gt;
+	attrP->lt = a->lt;
+	attrP->step = a->step;
+	attrP->notified = a->notified;
+	attrP->lastValue = a->lastValue;
+	return 1;
+}
+
+// Restore the notification attributes of a resource saved by
+// get_lua_object_attributes, periods start again at now.
+// return 0 if ok, -1 if the resource or memory is missing.
+int restore_lua_object_attributes(lwm2m_context_t * contextP,
+		lwm2m_uri_t * uriP, const llwm_attributes * attrP, time_t now) {
+	if (!(uriP->flag & LWM2M_URI_FLAG_RESOURCE_ID))
+		return -1;
+	lwm2m_object_t * objectP = prv_find_lua_object(contextP, uriP->objectId);
+	if (objectP == NULL)
+		return -1;
+	luaobject_userdata * userdata = (luaobject_userdata *) objectP->userData;
+	uint32_t key = (uint32_t) uriP->instanceId << 16 | uriP->resourceId;
+	luaobject_attributes * a = prv_find_attributes(userdata, key);
+	if (a == NULL) {
+		a = realloc(userdata->attributes,
+				(userdata->nbAttributes + 1) * sizeof(luaobject_attributes));
+		if (a == NULL)
+			return -1;
+		userdata->attributes = a;
+		a = &userdata->attributes[userdata->nbAttributes++];
+	}
+
+	memset(a, 0, sizeof(luaobject_attributes));
+	a->key = key;
+	a->flags = attrP->flags;
+	a->pmin = attrP->pmin;
+	a->pmax = attrP->pmax;
+	a->gt = attrP->gt;
+	a->lt = attrP->lt;
+	a->step = attrP->step;
+	a->notified = attrP->notified;
+	a->lastValue = attrP->lastValue;
+	a->lastTime = now;
+	return 0;
+}
+
+// return true if the new value should be notified regarding gt, lt and step attributes.
+static int prv_attributes_crossed(luaobject_attributes * a, lua_Number value) {
+	if (!a->notified
+			|| !(a->flags
+					& (LUAOBJECT_ATTR_GT | LUAOBJECT_ATTR_LT | LUAOBJECT_ATTR_STEP)))
+		return 1;
+	lua_Number last = a->lastValue;
+	if ((a->flags & LUAOBJECT_ATTR_GT) && ((last > a->gt) != (value > a->gt)))
+		return 1;
+	if ((a->flags & LUAOBJECT_ATTR_LT) && ((last < a->lt) != (value < a->lt)))
+		return 1;
+	if ((a->flags & LUAOBJECT_ATTR_STEP)
+			&& (value > last ? value - last : last - value) >= a->step)
+		return 1;
+	return 0;
+}
+
+// Tell wakaama the resource with the given key changed.
+static void prv_notify_resource(lwm2m_context_t * contextP,
+		lwm2m_object_t * objectP, uint32_t key) {
+	lwm2m_uri_t uri;
+	memset(&uri, 0, sizeof(lwm2m_uri_t));
+	uri.flag = LWM2M_URI_FLAG_OBJECT_ID | LWM2M_URI_FLAG_INSTANCE_ID
+			| LWM2M_URI_FLAG_RESOURCE_ID;
+	uri.objectId = objectP->objID;
+	uri.instanceId = key >> 16;
+	uri.resourceId = key & 0xFFFF;
+	lwm2m_resource_value_changed(contextP, &uri);
+}
+
+// Notify wakaama of all stored values changed since the last call,
+// regarding notification attributes of resources.
+// nextP is lowered to the time at which this function needs to be called again.
+// return the number of notified resources.
+int notify_lua_objects(lwm2m_context_t * contextP, time_t now, time_t * nextP) {
+	int n = 0;
+	int i;
+	for (i = 0; i < contextP->numObject; i++) {
+		lwm2m_object_t * objectP = contextP->objectList[i];
+		if (objectP->closeFunc != prv_close || objectP->userData == NULL)
+			continue;
+		luaobject_userdata * userdata = (luaobject_userdata *) objectP->userData;
+
+		// Changed values.
+		int j;
+		int kept = 0;
+		for (j = 0; j < userdata->nbDirty; j++) {
+			uint32_t key = userdata->dirty[j];
+			int index = prv_find_cached(userdata, key);
+			luaobject_cached * c = NULL;
+			if (index < userdata->nbCached && userdata->cached[index].key == key)
+				c = &userdata->cached[index];
+			luaobject_attributes * a = prv_find_attributes(userdata, key);
+
+			// Too early : keep it until pmin is reached.
+			if (a != NULL && (a->flags & LUAOBJECT_ATTR_PMIN) && a->notified
+					&& now < a->lastTime + a->pmin) {
+				userdata->dirty[kept++] = key;
+				if (a->lastTime + a->pmin < *nextP)
+					*nextP = a->lastTime + a->pmin;
+				continue;
+			}
+			if (c != NULL)
+				c->dirty = 0;
+
+			// Thresholds not crossed : nothing to notify.
+			if (a != NULL && c != NULL && c->numeric
+					&& !prv_attributes_crossed(a, c->number))
+				continue;
+
+			prv_notify_resource(contextP, objectP, key);
+			n++;
+			if (a != NULL) {
+				a->notified = 1;
+				a->lastTime = now;
+				if (c != NULL && c->numeric)
+					a->lastValue = c->number;
+			}
+		}
+		userdata->nbDirty = kept;
+
+		// Notifications due because of pmax.
+		for (j = 0; j < userdata->nbAttributes; j++) {
+			luaobject_attributes * a = &userdata->attributes[j];
+			if (!(a->flags & LUAOBJECT_ATTR_PMAX))
+				continue;
+			if (now >= a->lastTime + a->pmax) {
+				prv_notify_resource(contextP, objectP, a->key);
+				n++;
+				a->notified = 1;
+				a->lastTime = now;
+				int index = prv_find_cached(userdata, a->key);
+				if (index < userdata->nbCached
+						&& userdata->cached[index].key == a->key
+						&& userdata->cached[index].numeric)
+					a->lastValue = userdata->cached[index].number;
+			}
+			if (a->lastTime + a->pmax < *nextP)
+				*nextP = a->lastTime + a->pmax;
+		}
+	}
+	return n;
+}
+
+// Resume coroutines of pending calls of all lua objects of the context.
+// A finished read updates the last value of the resource and notifies it.
+// A call which ends in error is forgotten and counted in the asyncerrors stat
+// (the step goes on), the next reads of the resource fail.
+// return the number of calls still pending.
+int resume_lua_objects(lwm2m_context_t * contextP) {
+	int n = 0;
+	int i;
+	for (i = 0; i < contextP->numObject; i++) {
+		lwm2m_object_t * objectP = contextP->objectList[i];
+		if (objectP->closeFunc != prv_close || objectP->userData == NULL)
+			continue;
+		luaobject_userdata * userdata = (luaobject_userdata *) objectP->userData;
+		lua_State * L = userdata->L;
+
+		int j = 0;
+		while (j < userdata->nbPending) {
+			lua_State * co = userdata->pending[j].co;
+			int status = lua_resume(co, 0);
+			// (pending array can be changed by the coroutine)
+			luaobject_pending pending = userdata->pending[j];
+			if (status == LUA_YIELD) {
+				j++;
+				continue;
+			}
+
+			// Call is done : keep the read value and notify it.
+			if (status == 0 && pending.mode == LUAOBJECT_MODE_READ) {
+				lua_settop(co, 1);
+				lua_xmove(co, L, 1); // stack: ..., value
+				lwm2m_data_t data;
+				memset(&data, 0, sizeof(lwm2m_data_t));
+				if (prv_luaToResourceData(L, userdata, pending.key & 0xFFFF,
+						&data, LWM2M_TYPE_RESOURCE) == COAP_NO_ERROR) {
+					prv_set_last(L, userdata, pending.key, &data);
+					prv_notify_resource(contextP, objectP, pending.key);
+				}
+				lua_pop(L, 1); // stack: ...
+				prv_free_value(&data);
+			}
+
+			// Forget it.
+			userdata->pending[j] = userdata->pending[--userdata->nbPending];
+			if (status != 0) {
+				if (pending.mode == LUAOBJECT_MODE_READ)
+					prv_set_failed(userdata, pending.key);
+				if (userdata->stats != NULL)
+					userdata->stats->asyncErrors++;
+			}
+			luaL_unref(L, LUA_REGISTRYINDEX, pending.threadRef);
+		}
+		n += userdata->nbPending;
+	}
+	return n;
+}
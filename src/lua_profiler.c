@@ -0,0 +1,215 @@
+/*
+ MIT License (MIT)
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ */
+
+// The profiler attributes the time spent in object callbacks to their uri :
+// - it is disabled by default, then llwm_profile_start only reads a flag,
+// - time and call count are kept by kind and uri in a sorted array, the
+//   most expensive ones are only sorted when they are read from Lua,
+// - callbacks longer than a threshold are given to a Lua hook.
+
+#include "lua5.1/lua.h"
+#include "lua5.1/lauxlib.h"
+#include "lua5.1/lualib.h"
+
+#include "lua_liblwm2m.h"
+#include <string.h>
+#include <stdlib.h>
+
+static uint64_t prv_key(llwm_stat_kind kind, uint16_t objectId,
+		uint16_t instanceId, uint16_t resourceId) {
+	return (uint64_t) kind << 48 | (uint64_t) objectId << 32
+			| (uint64_t) instanceId << 16 | resourceId;
+}
+
+// Push the uri of the given key on the stack.
+static void prv_push_uri(lua_State * L, uint64_t key) {
+	uint16_t instanceId = (key >> 16) & 0xFFFF;
+	uint16_t resourceId = key & 0xFFFF;
+	lua_pushfstring(L, "/%d", (int) ((key >> 32) & 0xFFFF));
+	if (instanceId != LLWM_PROFILE_NO_ID) {
+		lua_pushfstring(L, "/%d", instanceId);
+		lua_concat(L, 2);
+		if (resourceId != LLWM_PROFILE_NO_ID) {
+			lua_pushfstring(L, "/%d", resourceId);
+			lua_concat(L, 2);
+		}
+	}
+}
+
+// Search the entry of the given key,
+// return the index where it is (or should be inserted).
+static int prv_find_entry(llwm_profiler * profiler, uint64_t key) {
+	int low = 0;
+	int high = profiler->nbEntries;
+	while (low < high) {
+		int mid = (low + high) / 2;
+		if (profiler->entries[mid].key < key)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+void llwm_profile_init(llwm_profiler * profiler, lua_State * L) {
+	memset(profiler, 0, sizeof(llwm_profiler));
+	profiler->L = L;
+	profiler->hookRef = LUA_NOREF;
+}
+
+// Enable or disable the profiler (hookRef is owned by the profiler),
+// counted callbacks are forgotten.
+void llwm_profile_enable(llwm_profiler * profiler, int enable,
+		int64_t threshold, int hookRef) {
+	luaL_unref(profiler->L, LUA_REGISTRYINDEX, profiler->hookRef);
+	profiler->hookRef = hookRef;
+	profiler->threshold = threshold;
+	profiler->enabled = enable;
+	profiler->nbEntries = 0;
+	profiler->missed = 0;
+}
+
+// Get the start time of a callback, or 0 if the profiler is disabled.
+int64_t llwm_profile_start(llwm_profiler * profiler) {
+	if (profiler == NULL || !profiler->enabled)
+		return 0;
+	return llwm_monotonic_time_us();
+}
+
+// Count the time elapsed since start in the callback of the given kind and uri
+// (LLWM_PROFILE_NO_ID for a missing instance or resource id).
+void llwm_profile_record(llwm_profiler * profiler, llwm_stat_kind kind,
+		uint16_t objectId, uint16_t instanceId, uint16_t resourceId,
+		int64_t start) {
+	if (start == 0 || profiler == NULL || !profiler->enabled)
+		return;
+	int64_t elapsed = llwm_monotonic_time_us() - start;
+	if (elapsed < 0)
+		elapsed = 0;
+
+	// Get the entry of the uri, add it if needed.
+	uint64_t key = prv_key(kind, objectId, instanceId, resourceId);
+	int index = prv_find_entry(profiler, key);
+	if (index == profiler->nbEntries || profiler->entries[index].key != key) {
+		if (profiler->nbEntries >= LLWM_PROFILE_MAX_ENTRIES) {
+			profiler->missed++;
+			index = -1;
+		} else {
+			if (profiler->nbEntries == profiler->capacity) {
+				int capacity = profiler->capacity ? profiler->capacity * 2 : 16;
+				llwm_profile_entry * entries = realloc(profiler->entries,
+						capacity * sizeof(llwm_profile_entry));
+				if (entries == NULL)
+					return;
+				profiler->entries = entries;
+				profiler->capacity = capacity;
+			}
+			memmove(&profiler->entries[index + 1], &profiler->entries[index],
+					(profiler->nbEntries - index) * sizeof(llwm_profile_entry));
+			memset(&profiler->entries[index], 0, sizeof(llwm_profile_entry));
+			profiler->entries[index].key = key;
+			profiler->nbEntries++;
+		}
+	}
+	if (index >= 0) {
+		llwm_profile_entry * entry = &profiler->entries[index];
+		entry->count++;
+		entry->total += elapsed;
+		if ((uint64_t) elapsed > entry->max)
+			entry->max = elapsed;
+	}
+
+	// Give slow callbacks to the hook : hook(uri, kind, elapsed).
+	if (profiler->threshold > 0 && elapsed >= profiler->threshold
+			&& profiler->hookRef != LUA_NOREF && profiler->hookRef != LUA_REFNIL) {
+		lua_State * L = profiler->L;
+		lua_rawgeti(L, LUA_REGISTRYINDEX, profiler->hookRef); // stack: ..., hook
+		prv_push_uri(L, key); // stack: ..., hook, uri
+		lua_pushstring(L, llwm_stats_kind_name(kind)); // stack: ..., hook, uri, kind
+		lua_pushnumber(L, elapsed); // stack: ..., hook, uri, kind, elapsed
+		// an error in the hook must not fail the request.
+		if (lua_pcall(L, 3, 0, 0) != 0)
+			lua_pop(L, 1); // stack: ...
+	}
+}
+
+static int prv_compare_total(const void * a, const void * b) {
+	const llwm_profile_entry * ea = a;
+	const llwm_profile_entry * eb = b;
+	if (ea->total != eb->total)
+		return ea->total < eb->total ? 1 : -1;
+	return ea->key < eb->key ? -1 : ea->key > eb->key;
+}
+
+// Push the list of the n callbacks with the highest total time and the number
+// of callbacks which could not be counted.
+void llwm_profile_push_top(lua_State * L, llwm_profiler * profiler, int n) {
+	if (n > profiler->nbEntries)
+		n = profiler->nbEntries;
+	if (n < 0)
+		n = 0;
+
+	// Sort a copy, entries stay sorted by key.
+	llwm_profile_entry * sorted = NULL;
+	if (n > 0) {
+		sorted = malloc(profiler->nbEntries * sizeof(llwm_profile_entry));
+		if (sorted == NULL)
+			n = 0;
+		else {
+			memcpy(sorted, profiler->entries,
+					profiler->nbEntries * sizeof(llwm_profile_entry));
+			qsort(sorted, profiler->nbEntries, sizeof(llwm_profile_entry),
+					prv_compare_total);
+		}
+	}
+
+	lua_createtable(L, n, 0); // stack: ..., list
+	int i;
+	for (i = 0; i < n; i++) {
+		llwm_profile_entry * entry = &sorted[i];
+		lua_createtable(L, 0, 6); // stack: ..., list, entry
+		prv_push_uri(L, entry->key);
+		lua_setfield(L, -2, "uri");
+		lua_pushstring(L, llwm_stats_kind_name(entry->key >> 48));
+		lua_setfield(L, -2, "kind");
+		lua_pushnumber(L, entry->count);
+		lua_setfield(L, -2, "count");
+		lua_pushnumber(L, entry->total);
+		lua_setfield(L, -2, "total");
+		lua_pushnumber(L, (lua_Number) entry->total / entry->count);
+		lua_setfield(L, -2, "mean");
+		lua_pushnumber(L, entry->max);
+		lua_setfield(L, -2, "max");
+		lua_rawseti(L, -2, i + 1); // stack: ..., list
+	}
+	free(sorted);
+	lua_pushnumber(L, profiler->missed); // stack: ..., list, missed
+}
+
+void llwm_profile_release(llwm_profiler * profiler) {
+	luaL_unref(profiler->L, LUA_REGISTRYINDEX, profiler->hookRef);
+	profiler->hookRef = LUA_NOREF;
+	profiler->enabled = 0;
+	free(profiler->entries);
+	profiler->entries = NULL;
+	profiler->nbEntries = profiler->capacity = 0;
+}
@@ -0,0 +1,177 @@
+/*
+ MIT License (MIT)
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ */
+
+// Statistics are always on, so they only cost a few increments :
+// - packet counters are updated where packets are handled and sent,
+// - latencies are counted in fixed-size log-linear histograms (no allocation),
+//   percentiles are only computed when statistics are read from Lua.
+
+#include "lua5.1/lua.h"
+#include "lua5.1/lauxlib.h"
+#include "lua5.1/lualib.h"
+
+#include "lua_liblwm2m.h"
+#include <string.h>
+
+static const char * prv_kind_names[LLWM_STAT_COUNT] = { "handle", "step",
+		"read", "write", "execute", "create", "delete" };
+
+const char * llwm_stats_kind_name(llwm_stat_kind kind) {
+	return prv_kind_names[kind];
+}
+
+// Get the bucket of the given value.
+static int prv_bucket(uint64_t value) {
+	if (value < (1 << LLWM_HISTO_SUB_BITS))
+		return value;
+	int exponent = 63 - __builtin_clzll(value);
+	int shift = exponent - LLWM_HISTO_SUB_BITS;
+	int index = ((shift + 1) << LLWM_HISTO_SUB_BITS)
+			+ ((value >> shift) & ((1 << LLWM_HISTO_SUB_BITS) - 1));
+	return index < LLWM_HISTO_BUCKETS ? index : LLWM_HISTO_BUCKETS - 1;
+}
+
+// Get the highest value counted in the given bucket.
+static uint64_t prv_bucket_max(int index) {
+	if (index < (1 << LLWM_HISTO_SUB_BITS))
+		return index;
+	int shift = (index >> LLWM_HISTO_SUB_BITS) - 1;
+	uint64_t mantissa = (index & ((1 << LLWM_HISTO_SUB_BITS) - 1))
+			+ (1 << LLWM_HISTO_SUB_BITS);
+	return ((mantissa + 1) << shift) - 1;
+}
+
+// Count the time elapsed since start (in microseconds from llwm_monotonic_time_us).
+void llwm_stats_record(llwm_stats * stats, llwm_stat_kind kind, int64_t start) {
+	if (stats == NULL)
+		return;
+	int64_t elapsed = llwm_monotonic_time_us() - start;
+	if (elapsed < 0)
+		elapsed = 0;
+
+	llwm_histogram * histo = &stats->histograms[kind];
+	histo->count++;
+	histo->sum += elapsed;
+	if ((uint64_t) elapsed > histo->max)
+		histo->max = elapsed;
+	histo->buckets[prv_bucket(elapsed)]++;
+}
+
+// Count a packet sent, a confirmable message already sent with the same
+// message id is a retransmission.
+void llwm_stats_sent(llwm_stats * stats, const uint8_t * buffer, size_t length) {
+	stats->sent++;
+	stats->bytesSent += length;
+	if (length < 4 || ((buffer[0] >> 4) & 0x03) != 0) // not confirmable
+		return;
+
+	uint16_t mid = (buffer[2] << 8) | buffer[3];
+	int i;
+	for (i = 0; i < stats->recentCount; i++) {
+		if (stats->recentMids[i] == mid) {
+			stats->retransmissions++;
+			return;
+		}
+	}
+	stats->recentMids[stats->recentNext] = mid;
+	stats->recentNext = (stats->recentNext + 1) % LLWM_STATS_RECENT_MIDS;
+	if (stats->recentCount < LLWM_STATS_RECENT_MIDS)
+		stats->recentCount++;
+}
+
+// Add the statistics of src to dst.
+void llwm_stats_merge(llwm_stats * dst, const llwm_stats * src) {
+	dst->received += src->received;
+	dst->dropped += src->dropped;
+	dst->sent += src->sent;
+	dst->paced += src->paced;
+	dst->sendErrors += src->sendErrors;
+	dst->retransmissions += src->retransmissions;
+	dst->unsaved += src->unsaved;
+	dst->asyncErrors += src->asyncErrors;
+	dst->bytesReceived += src->bytesReceived;
+	dst->bytesSent += src->bytesSent;
+
+	int kind, i;
+	for (kind = 0; kind < LLWM_STAT_COUNT; kind++) {
+		llwm_histogram * d = &dst->histograms[kind];
+		const llwm_histogram * s = &src->histograms[kind];
+		d->count += s->count;
+		d->sum += s->sum;
+		if (s->max > d->max)
+			d->max = s->max;
+		for (i = 0; i < LLWM_HISTO_BUCKETS; i++)
+			d->buckets[i] += s->buckets[i];
+	}
+}
+
+// Get the value under which the given ratio of the values are.
+static uint64_t prv_percentile(const llwm_histogram * histo, double ratio) {
+	uint64_t rank = (uint64_t) (histo->count * ratio);
+	if (rank < histo->count)
+		rank++;
+	uint64_t seen = 0;
+	int i;
+	for (i = 0; i < LLWM_HISTO_BUCKETS; i++) {
+		seen += histo->buckets[i];
+		if (seen >= rank && seen > 0) {
+			uint64_t value = prv_bucket_max(i);
+			return value < histo->max ? value : histo->max;
+		}
+	}
+	return histo->max;
+}
+
+static void prv_set_number(lua_State * L, const char * name, lua_Number value) {
+	lua_pushnumber(L, value);
+	lua_setfield(L, -2, name);
+}
+
+// Push a table with the given statistics on the stack (latencies in microseconds).
+void llwm_stats_push(lua_State * L, const llwm_stats * stats) {
+	lua_createtable(L, 0, 10 + LLWM_STAT_COUNT); // stack: ..., stats
+	prv_set_number(L, "received", stats->received);
+	prv_set_number(L, "dropped", stats->dropped);
+	prv_set_number(L, "sent", stats->sent);
+	prv_set_number(L, "paced", stats->paced);
+	prv_set_number(L, "senderrors", stats->sendErrors);
+	prv_set_number(L, "retransmissions", stats->retransmissions);
+	prv_set_number(L, "unsaved", stats->unsaved);
+	prv_set_number(L, "asyncerrors", stats->asyncErrors);
+	prv_set_number(L, "bytesreceived", stats->bytesReceived);
+	prv_set_number(L, "bytessent", stats->bytesSent);
+
+	int kind;
+	for (kind = 0; kind < LLWM_STAT_COUNT; kind++) {
+		const llwm_histogram * histo = &stats->histograms[kind];
+		lua_createtable(L, 0, 7); // stack: ..., stats, histogram
+		prv_set_number(L, "count", histo->count);
+		prv_set_number(L, "mean",
+				histo->count > 0 ? (lua_Number) histo->sum / histo->count : 0);
+		prv_set_number(L, "max", histo->max);
+		prv_set_number(L, "p50", prv_percentile(histo, 0.5));
+		prv_set_number(L, "p90", prv_percentile(histo, 0.9));
+		prv_set_number(L, "p99", prv_percentile(histo, 0.99));
+		prv_set_number(L, "p999", prv_percentile(histo, 0.999));
+		lua_setfield(L, -2, prv_kind_names[kind]); // stack: ..., stats
+	}
+}
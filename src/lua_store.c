@@ -0,0 +1,606 @@
+/*
+ MIT License (MIT)
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ */
+
+// The store keeps the state of contexts in a file mapped in memory, so a
+// restarted process resumes registrations and observations :
+// - each context owns a fixed-size record, found by endpoint name (open
+//   addressing), records are only written after a step which handled or sent
+//   packets, or changed the state of a server,
+// - at start, a context with a live registration sends an update instead of a
+//   register, and observations are restored with their tokens and counters,
+// - if the server rejects the update of a resumed registration (e.g. it forgot
+//   the location), the client registers again from scratch,
+// - registration deadlines are wall-clock times (as wakaama ones),
+// - records carry a checksum : a record which was half written (the process
+//   died while saving it) or whose counts are out of range is not resumed.
+// wakaama has no API for this : the store relies on the internals of the
+// liblwm2m revision of the submodule (early 2015 core, before the registration
+// rewrite) : lwm2m_server_t status, location and registration fields,
+// lwm2m_observed_t and lwm2m_watcher_t lists, and transaction_remove and
+// registration_start from internals.h.
+
+#include "lua5.1/lua.h"
+#include "lua5.1/lauxlib.h"
+#include "lua5.1/lualib.h"
+
+#include "lua_liblwm2m.h"
+#include "internals.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LLWM_STORE_MAGIC 0x4C4C5753 // "LLWS"
+#define LLWM_STORE_VERSION 2
+#define LLWM_STORE_DEFAULT_CAPACITY 1024
+// Lifetime used for deadlines when the server has none (LWM2M default).
+#define LLWM_STORE_DEFAULT_LIFETIME 86400
+
+typedef struct llwm_store_server {
+	uint16_t shortID;
+	uint8_t registered;
+	int64_t deadline;          // wall-clock end of the registration lifetime
+	char location[LLWM_STORE_LOCATION_SIZE];
+	struct sockaddr_storage addr; // address of the session (addrLen is 0 if unresolved)
+	uint32_t addrLen;
+} llwm_store_server;
+
+typedef struct llwm_store_observation {
+	uint8_t uriFlag;
+	uint16_t objectId;
+	uint16_t instanceId;
+	uint16_t resourceId;
+	uint16_t shortID;          // server of the watcher
+	uint8_t token[8];
+	uint8_t tokenLen;
+	uint32_t counter;
+	uint8_t hasAttributes;
+	llwm_attributes attributes;
+} llwm_store_observation;
+
+typedef struct llwm_store_record {
+	uint8_t used;
+	uint32_t checksum;         // of the record, with this field set to 0
+	char endpoint[LLWM_STORE_ENDPOINT_SIZE];
+	uint8_t nbServers;
+	llwm_store_server servers[LLWM_STORE_MAX_SERVERS];
+	uint8_t nbObservations;
+	llwm_store_observation observations[LLWM_STORE_MAX_OBSERVATIONS];
+} llwm_store_record;
+
+struct llwm_store_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t recordSize;
+	uint32_t capacity;
+	llwm_store_record records[];
+};
+
+static llwm_store * checkstore(lua_State * L, const char * functionname) {
+	llwm_store * store = (llwm_store *) luaL_checkudata(L, 1, "lualwm2m.store");
+	if (store->header == NULL)
+		luaL_error(L, "bad argument #1 to '%s' (store is closed)", functionname);
+	return store;
+}
+
+// FNV-1a hash of the endpoint name.
+static uint32_t prv_hash(const char * endpoint) {
+	uint32_t hash = 2166136261u;
+	while (*endpoint) {
+		hash ^= (uint8_t) *endpoint++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// FNV-1a hash of the record, its checksum field being 0.
+static uint32_t prv_checksum(llwm_store_record * record) {
+	uint32_t checksum = record->checksum;
+	record->checksum = 0;
+	uint32_t hash = 2166136261u;
+	const uint8_t * bytes = (const uint8_t *) record;
+	size_t i;
+	for (i = 0; i < sizeof(llwm_store_record); i++) {
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+	record->checksum = checksum;
+	return hash;
+}
+
+// Forget the servers and observations saved in the record.
+static void prv_clear_record(llwm_store_record * record) {
+	record->nbServers = 0;
+	memset(record->servers, 0, sizeof(record->servers));
+	record->nbObservations = 0;
+	memset(record->observations, 0, sizeof(record->observations));
+	record->checksum = prv_checksum(record);
+}
+
+// Return true if the record read from the file can be used : its checksum
+// matches and its counts are in range.
+static int prv_valid_record(llwm_store_record * record) {
+	if (record->checksum != prv_checksum(record)
+			|| record->nbServers > LLWM_STORE_MAX_SERVERS
+			|| record->nbObservations > LLWM_STORE_MAX_OBSERVATIONS)
+		return 0;
+	int i;
+	for (i = 0; i < record->nbServers; i++) {
+		if (record->servers[i].addrLen > sizeof(struct sockaddr_storage)
+				|| memchr(record->servers[i].location, '\0',
+						LLWM_STORE_LOCATION_SIZE) == NULL)
+			return 0;
+	}
+	for (i = 0; i < record->nbObservations; i++) {
+		if (record->observations[i].tokenLen > 8)
+			return 0;
+	}
+	return 1;
+}
+
+// Get the record of the context, or NULL if it has no store.
+static llwm_store_record * prv_record(llwm_userdata * lwu) {
+	if (lwu->store == NULL || lwu->store->header == NULL || lwu->storeIndex < 0)
+		return NULL;
+	return &lwu->store->header->records[lwu->storeIndex];
+}
+
+// Attach the record of the given endpoint to the context (it is created if
+// needed), return 0 if ok, -1 if the store is full.
+int llwm_store_attach(llwm_userdata * lwu, llwm_store * store,
+		const char * endpoint) {
+	struct llwm_store_header * header = store->header;
+	uint32_t capacity = header->capacity;
+	uint32_t index = prv_hash(endpoint) % capacity;
+	uint32_t i;
+	for (i = 0; i < capacity; i++, index = (index + 1) % capacity) {
+		llwm_store_record * record = &header->records[index];
+		if (!record->used) {
+			memset(record, 0, sizeof(llwm_store_record));
+			strncpy(record->endpoint, endpoint, LLWM_STORE_ENDPOINT_SIZE - 1);
+			record->used = 1;
+			record->checksum = prv_checksum(record);
+		} else if (strncmp(record->endpoint, endpoint,
+				LLWM_STORE_ENDPOINT_SIZE) != 0) {
+			continue;
+		}
+		lwu->store = store;
+		lwu->storeIndex = index;
+		return 0;
+	}
+	return -1;
+}
+
+// Get the saved registration of the given server if it can be resumed :
+// still alive and with the same server address.
+static llwm_store_server * prv_resumable(llwm_store_record * record,
+		lwm2m_server_t * serverP, time_t now) {
+	int i;
+	for (i = 0; i < record->nbServers; i++) {
+		llwm_store_server * saved = &record->servers[i];
+		if (saved->shortID != serverP->shortID)
+			continue;
+		if (!saved->registered || saved->location[0] == '\0'
+				|| saved->deadline <= now)
+			return NULL;
+		llwm_addr_t * la = serverP->sessionH;
+		if (la != NULL && la->addrLen != 0 && saved->addrLen != 0
+				&& (la->addrLen != saved->addrLen
+						|| memcmp(&la->addr, &saved->addr, la->addrLen) != 0))
+			return NULL;
+		return saved;
+	}
+	return NULL;
+}
+
+// Return true if a packet to the given session must be dropped : while a
+// context is resumed, the register messages sent by lwm2m_start are replaced
+// by registration updates.
+int llwm_store_mutes(llwm_userdata * lwu, llwm_addr_t * la) {
+	llwm_store_record * record = prv_record(lwu);
+	if (!lwu->resuming || record == NULL)
+		return 0;
+	time_t now = time(NULL);
+	lwm2m_server_t * serverP;
+	for (serverP = lwu->ctx->serverList; serverP != NULL;
+			serverP = serverP->next) {
+		if (serverP->sessionH == la && prv_resumable(record, serverP, now))
+			return 1;
+	}
+	return 0;
+}
+
+// Add a saved observation to the observations of the context.
+static int prv_restore_observation(lwm2m_context_t * contextP,
+		llwm_store_observation * saved, lwm2m_server_t * serverP, time_t now) {
+	lwm2m_uri_t uri;
+	memset(&uri, 0, sizeof(lwm2m_uri_t));
+	uri.flag = saved->uriFlag;
+	uri.objectId = saved->objectId;
+	uri.instanceId = saved->instanceId;
+	uri.resourceId = saved->resourceId;
+
+	// Get the observed uri, add it if needed.
+	lwm2m_observed_t * observedP;
+	for (observedP = contextP->observedList; observedP != NULL;
+			observedP = observedP->next) {
+		if (memcmp(&observedP->uri, &uri, sizeof(lwm2m_uri_t)) == 0)
+			break;
+	}
+	if (observedP == NULL) {
+		observedP = malloc(sizeof(lwm2m_observed_t));
+		if (observedP == NULL)
+			return -1;
+		memset(observedP, 0, sizeof(lwm2m_observed_t));
+		observedP->uri = uri;
+		observedP->next = contextP->observedList;
+		contextP->observedList = observedP;
+	}
+
+	lwm2m_watcher_t * watcherP = malloc(sizeof(lwm2m_watcher_t));
+	if (watcherP == NULL)
+		return -1;
+	memset(watcherP, 0, sizeof(lwm2m_watcher_t));
+	watcherP->server = serverP;
+	memcpy(watcherP->token, saved->token, saved->tokenLen);
+	watcherP->tokenLen = saved->tokenLen;
+	watcherP->counter = saved->counter;
+	watcherP->next = observedP->watcherList;
+	observedP->watcherList = watcherP;
+
+	if (saved->hasAttributes)
+		restore_lua_object_attributes(contextP, &uri, &saved->attributes, now);
+	return 0;
+}
+
+// Forget the observations of the given server restored from the store.
+static void prv_forget_observations(lwm2m_context_t * contextP,
+		lwm2m_server_t * serverP) {
+	lwm2m_observed_t * observedP;
+	for (observedP = contextP->observedList; observedP != NULL;
+			observedP = observedP->next) {
+		lwm2m_watcher_t ** watcherP = &observedP->watcherList;
+		while (*watcherP != NULL) {
+			if ((*watcherP)->server == serverP) {
+				lwm2m_watcher_t * nextP = (*watcherP)->next;
+				free(*watcherP);
+				*watcherP = nextP;
+			} else {
+				watcherP = &(*watcherP)->next;
+			}
+		}
+	}
+}
+
+// Give up the resumed registration of the given server : it registers again
+// (with the next registration_start).
+static void prv_unresume(lwm2m_context_t * contextP, lwm2m_server_t * serverP) {
+	prv_forget_observations(contextP, serverP);
+	free(serverP->location);
+	serverP->location = NULL;
+	serverP->status = STATE_DEREGISTERED;
+}
+
+// Check the updates sent for resumed registrations : a rejected one is replaced
+// by a new registration.
+static void prv_check_resumed(llwm_userdata * lwu) {
+	int reregister = 0;
+	int i = 0;
+	while (i < lwu->nbResumed) {
+		lwm2m_server_t * serverP = lwu->ctx->serverList;
+		while (serverP != NULL && serverP->shortID != lwu->resumed[i])
+			serverP = serverP->next;
+		if (serverP != NULL && serverP->status == STATE_REG_UPDATE_PENDING) {
+			i++;
+			continue;
+		}
+		if (serverP != NULL && serverP->status == STATE_REG_FAILED) {
+			prv_unresume(lwu->ctx, serverP);
+			reregister = 1;
+		}
+		lwu->resumed[i] = lwu->resumed[--lwu->nbResumed];
+	}
+	if (reregister) {
+		registration_start(lwu->ctx);
+		lwu->storeDirty = 1;
+	}
+}
+
+// Start the context, resuming registrations and observations saved in its
+// record.
+void llwm_store_start(llwm_userdata * lwu) {
+	lwm2m_context_t * contextP = lwu->ctx;
+
+	// A corrupted record is not resumed : clients register again.
+	llwm_store_record * record = prv_record(lwu);
+	if (record != NULL && !prv_valid_record(record))
+		prv_clear_record(record);
+
+	lwu->resuming = 1;
+	lwm2m_start(contextP);
+	lwu->resuming = 0;
+	lwu->storeDirty = 1;
+	lwu->nbResumed = 0;
+
+	if (record == NULL)
+		return;
+	time_t now = time(NULL);
+	lwm2m_server_t * serverP;
+	for (serverP = contextP->serverList; serverP != NULL;
+			serverP = serverP->next) {
+		llwm_store_server * saved = prv_resumable(record, serverP, now);
+		if (saved == NULL)
+			continue;
+		// Without location, the dropped register is retransmitted by wakaama.
+		char * location = strdup(saved->location);
+		if (location == NULL)
+			continue;
+
+		// Forget the register transaction, then update the registration.
+		lwm2m_transaction_t * transacP = contextP->transactionList;
+		while (transacP != NULL) {
+			lwm2m_transaction_t * nextP = transacP->next;
+			if (transacP->peerP == serverP)
+				transaction_remove(contextP, transacP);
+			transacP = nextP;
+		}
+		free(serverP->location);
+		serverP->location = location;
+		serverP->status = STATE_REGISTERED;
+		serverP->registration = now;
+		if (lwm2m_update_registration(contextP, serverP->shortID) != 0) {
+			prv_unresume(contextP, serverP);
+			registration_start(contextP);
+			continue;
+		}
+		lwu->resumed[lwu->nbResumed++] = serverP->shortID;
+
+		// Restore observations of this server.
+		int i;
+		for (i = 0; i < record->nbObservations; i++) {
+			if (record->observations[i].shortID == serverP->shortID)
+				prv_restore_observation(contextP, &record->observations[i],
+						serverP, now);
+		}
+	}
+}
+
+// Fill the given record with the current state of the context.
+// return the number of servers and observations which did not fit in it.
+static int prv_snapshot(llwm_userdata * lwu, llwm_store_record * record,
+		const char * endpoint) {
+	int dropped = 0;
+	memset(record, 0, sizeof(llwm_store_record));
+	record->used = 1;
+	memcpy(record->endpoint, endpoint, LLWM_STORE_ENDPOINT_SIZE);
+
+	lwm2m_server_t * serverP;
+	for (serverP = lwu->ctx->serverList; serverP != NULL;
+			serverP = serverP->next) {
+		if (record->nbServers == LLWM_STORE_MAX_SERVERS) {
+			dropped++;
+			continue;
+		}
+		llwm_store_server * saved = &record->servers[record->nbServers++];
+		saved->shortID = serverP->shortID;
+		saved->registered = (serverP->status == STATE_REGISTERED
+				|| serverP->status == STATE_REG_UPDATE_PENDING)
+				&& serverP->location != NULL
+				&& strlen(serverP->location) < LLWM_STORE_LOCATION_SIZE;
+		if (saved->registered)
+			strcpy(saved->location, serverP->location);
+		saved->deadline = (int64_t) serverP->registration
+				+ (serverP->lifetime > 0 ?
+						serverP->lifetime : LLWM_STORE_DEFAULT_LIFETIME);
+		llwm_addr_t * la = serverP->sessionH;
+		if (la != NULL && la->addrLen != 0) {
+			memcpy(&saved->addr, &la->addr, la->addrLen);
+			saved->addrLen = la->addrLen;
+		}
+	}
+
+	lwm2m_observed_t * observedP;
+	for (observedP = lwu->ctx->observedList; observedP != NULL;
+			observedP = observedP->next) {
+		lwm2m_watcher_t * watcherP;
+		for (watcherP = observedP->watcherList; watcherP != NULL;
+				watcherP = watcherP->next) {
+			if (record->nbObservations == LLWM_STORE_MAX_OBSERVATIONS) {
+				dropped++;
+				continue;
+			}
+			llwm_store_observation * saved =
+					&record->observations[record->nbObservations++];
+			saved->uriFlag = observedP->uri.flag;
+			saved->objectId = observedP->uri.objectId;
+			saved->instanceId = observedP->uri.instanceId;
+			saved->resourceId = observedP->uri.resourceId;
+			saved->shortID = watcherP->server->shortID;
+			saved->tokenLen = watcherP->tokenLen;
+			memcpy(saved->token, watcherP->token, watcherP->tokenLen);
+			saved->counter = watcherP->counter;
+			saved->hasAttributes = get_lua_object_attributes(lwu->ctx,
+					&observedP->uri, &saved->attributes);
+		}
+	}
+	return dropped;
+}
+
+// Fingerprint of the state of the servers : it changes when a registration is
+// done, updated or lost without packets being handled (e.g. on timeouts).
+static uint32_t prv_servers_fingerprint(lwm2m_context_t * contextP) {
+	uint32_t hash = 2166136261u;
+	lwm2m_server_t * serverP;
+	for (serverP = contextP->serverList; serverP != NULL;
+			serverP = serverP->next) {
+		uint32_t values[] = { serverP->shortID, serverP->status,
+				(uint32_t) serverP->registration, (uint32_t) serverP->lifetime,
+				(uint32_t) (uintptr_t) serverP->location,
+				(uint32_t) (uintptr_t) serverP->sessionH };
+		size_t i;
+		for (i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+			hash ^= values[i];
+			hash *= 16777619u;
+		}
+	}
+	return hash;
+}
+
+// Save the state of the context in its record if it may have changed since the
+// last save (see storeDirty).
+void llwm_store_save(llwm_userdata * lwu) {
+	llwm_store_record * record = prv_record(lwu);
+	if (record == NULL || lwu->ctx == NULL)
+		return;
+	if (lwu->nbResumed > 0)
+		prv_check_resumed(lwu);
+	uint32_t servers = prv_servers_fingerprint(lwu->ctx);
+	if (!lwu->storeDirty && servers == lwu->storeServers)
+		return;
+	lwu->storeDirty = 0;
+	lwu->storeServers = servers;
+
+	// The record is filled aside then copied with its checksum : if the process
+	// dies during the copy, the record is not resumed.
+	llwm_store_record current;
+	lwu->stats.unsaved += prv_snapshot(lwu, &current, record->endpoint);
+	current.checksum = prv_checksum(&current);
+	memcpy(record, &current, sizeof(llwm_store_record));
+}
+
+// Forget the state of a closed context (the record stays for the endpoint).
+void llwm_store_forget(llwm_userdata * lwu) {
+	llwm_store_record * record = prv_record(lwu);
+	if (record != NULL)
+		prv_clear_record(record);
+	lwu->store = NULL;
+	lwu->storeIndex = -1;
+}
+
+int llwm_store_new(lua_State * L) {
+	const char * path = luaL_checkstring(L, 1);
+	int capacity = luaL_optint(L, 2, LLWM_STORE_DEFAULT_CAPACITY);
+	if (capacity <= 0)
+		return luaL_error(L,
+				"bad argument #2 to 'store' (capacity should be positive)");
+
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return luaL_error(L, "unable to open store %s : %s", path,
+				strerror(errno));
+
+	// A new file is sized for the given capacity, an existing one keeps its own.
+	struct stat st;
+	struct llwm_store_header header;
+	if (fstat(fd, &st) < 0) {
+		int err = errno;
+		close(fd);
+		return luaL_error(L, "unable to open store %s : %s", path,
+				strerror(err));
+	}
+	int created = st.st_size == 0;
+	if (created) {
+		header.magic = LLWM_STORE_MAGIC;
+		header.version = LLWM_STORE_VERSION;
+		header.recordSize = sizeof(llwm_store_record);
+		header.capacity = capacity;
+	} else if (st.st_size < (off_t) sizeof(header)
+			|| pread(fd, &header, sizeof(header), 0) != sizeof(header)
+			|| header.magic != LLWM_STORE_MAGIC
+			|| header.version != LLWM_STORE_VERSION
+			|| header.recordSize != sizeof(llwm_store_record)
+			|| header.capacity == 0
+			|| st.st_size < (off_t) (sizeof(header)
+					+ (size_t) header.capacity * sizeof(llwm_store_record))) {
+		close(fd);
+		return luaL_error(L, "unable to open store %s : not a store file",
+				path);
+	}
+	size_t size = sizeof(header)
+			+ (size_t) header.capacity * sizeof(llwm_store_record);
+	if (created && ftruncate(fd, size) < 0) {
+		int err = errno;
+		close(fd);
+		return luaL_error(L, "unable to create store %s : %s", path,
+				strerror(err));
+	}
+
+	void * map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		int err = errno;
+		close(fd);
+		return luaL_error(L, "unable to map store %s : %s", path,
+				strerror(err));
+	}
+	if (created)
+		memcpy(map, &header, sizeof(header));
+
+	// Create store userdata object and set its metatable.
+	llwm_store * store = lua_newuserdata(L, sizeof(llwm_store)); // stack: path, [capacity], store
+	store->fd = fd;
+	store->size = size;
+	store->header = map;
+	luaL_getmetatable(L, "lualwm2m.store"); // stack: path, [capacity], store, metatable
+	lua_setmetatable(L, -2); // stack: path, [capacity], store
+	return 1;
+}
+
+static int store_close(lua_State * L) {
+	llwm_store * store = (llwm_store *) luaL_checkudata(L, 1, "lualwm2m.store");
+	if (store->header != NULL) {
+		munmap(store->header, store->size);
+		close(store->fd);
+		store->header = NULL;
+	}
+	return 0;
+}
+
+// Number of records used in the store.
+static int store_count(lua_State * L) {
+	llwm_store * store = checkstore(L, "count");
+	uint32_t i;
+	int count = 0;
+	for (i = 0; i < store->header->capacity; i++)
+		count += store->header->records[i].used;
+	lua_pushnumber(L, count);
+	return 1;
+}
+
+static const struct luaL_Reg store_objmeths[] = { { "count", store_count }, {
+		"close", store_close }, { "__gc", store_close }, { NULL, NULL } };
+
+void llwm_store_register(lua_State * L) {
+	// Define store object metatable.
+	luaL_newmetatable(L, "lualwm2m.store"); // stack: metatable
+
+	// Do : metatable.__index = metatable.
+	lua_pushvalue(L, -1); // stack: metatable, metatable
+	lua_setfield(L, -2, "__index"); // stack: metatable
+
+	// Register store object methods : set methods to table on top of the stack
+	luaL_register(L, NULL, store_objmeths); // stack: metatable
+	lua_pop(L, 1); // stack:
+}
@@ -0,0 +1,393 @@
+/*
+ MIT License (MIT)
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ */
+
+// Workers run fleets on several threads :
+// - contexts are sharded, each shard has its own lua_State (loaded with the
+//   same script) and its own fleet, so Lua callbacks of a shard are never run
+//   concurrently,
+// - ready shards (packet received or step due) are queued in one epoll
+//   instance shared by all worker threads : any idle thread takes the next
+//   ready shard, so busy threads never hold work back from idle ones.
+
+#include "lua5.1/lua.h"
+#include "lua5.1/lauxlib.h"
+#include "lua5.1/lualib.h"
+
+#include "lua_liblwm2m.h"
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+// Time (in milliseconds) after which an idle worker checks if it should stop.
+#define LLWM_WORKER_IDLE_TIMEOUT 100
+
+typedef struct llwm_shard {
+	lua_State * L;
+	llwm_fleet * fleet;
+	int fleetRef;           // reference on the fleet in the shard lua_State
+	int pollRef;            // reference on prv_shard_poll in the shard lua_State
+	int timerfd;            // wake up the shard when its next step is due
+	int queued;             // true once the shard is registered in the ready queue
+	pthread_mutex_t lock;
+	char * error;           // error message if the shard stopped on error
+	unsigned long iterations;
+} llwm_shard;
+
+typedef struct llwm_workers {
+	int epollfd;            // queue of ready shards
+	int running;
+	int nbShards;
+	llwm_shard * shards;
+	int nbThreads;
+	pthread_t * threads;
+	int started;            // number of started threads
+} llwm_workers;
+
+static llwm_workers * checkworkers(lua_State * L, const char * functionname) {
+	llwm_workers * workers = (llwm_workers *) luaL_checkudata(L, 1,
+			"lualwm2m.workers");
+
+	if (workers->shards == NULL)
+		luaL_error(L, "bad argument #1 to '%s' (workers object is closed)",
+				functionname);
+
+	return workers;
+}
+
+// Arm the timer of the shard for its next due step.
+static void prv_shard_arm_timer(llwm_shard * shard) {
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	int64_t next = llwm_fleet_next_step(shard->fleet);
+	its.it_value.tv_sec = next / 1000;
+	// (a zero value would disarm the timer, a time in the past fires now)
+	its.it_value.tv_nsec = (next % 1000) * 1000000 + 1;
+	timerfd_settime(shard->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+// Queue the shard in the ready queue again (one shot : only one worker gets it).
+static void prv_shard_rearm(llwm_workers * workers, llwm_shard * shard) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = shard;
+	epoll_ctl(workers->epollfd, shard->queued ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+			shard->fleet->epollfd, &ev);
+	shard->queued = 1;
+}
+
+// Do one iteration of the shard fleet (called in protected mode).
+static int prv_shard_poll(lua_State * L) {
+	llwm_shard * shard = (llwm_shard *) lua_touserdata(L, 1);
+	int err = llwm_fleet_poll(shard->fleet, 0);
+	if (err != 0)
+		return luaL_error(L, "fleet poll failed : %s", strerror(err));
+	return 0;
+}
+
+static void prv_shard_process(llwm_workers * workers, llwm_shard * shard) {
+	pthread_mutex_lock(&shard->lock);
+
+	// Clear timer expirations.
+	uint64_t expirations;
+	if (read(shard->timerfd, &expirations, sizeof(expirations)) < 0) {
+		// EAGAIN : woken up by a packet, not by the timer.
+	}
+
+	// Step due contexts and handle received packets.
+	lua_State * L = shard->L;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, shard->pollRef);
+	lua_pushlightuserdata(L, shard);
+	if (lua_pcall(L, 1, 0, 0) != 0) {
+		// Stop the shard : it is not queued again.
+		shard->error = strdup(lua_tostring(L, -1));
+		lua_pop(L, 1);
+		pthread_mutex_unlock(&shard->lock);
+		return;
+	}
+	shard->iterations++;
+	prv_shard_arm_timer(shard);
+
+	pthread_mutex_unlock(&shard->lock);
+	prv_shard_rearm(workers, shard);
+}
+
+static void * prv_worker_main(void * arg) {
+	llwm_workers * workers = (llwm_workers *) arg;
+
+	struct epoll_event ev;
+	while (__atomic_load_n(&workers->running, __ATOMIC_ACQUIRE)) {
+		int n = epoll_wait(workers->epollfd, &ev, 1, LLWM_WORKER_IDLE_TIMEOUT);
+		if (n == 1)
+			prv_shard_process(workers, (llwm_shard *) ev.data.ptr);
+	}
+	return NULL;
+}
+
+// Copy the value at the given index of L to the top of the stack of to.
+// Only strings, numbers and booleans can be copied.
+static void prv_copy_value(lua_State * L, int index, lua_State * to) {
+	size_t len;
+	const char * str;
+	switch (lua_type(L, index)) {
+	case LUA_TNUMBER:
+		lua_pushnumber(to, lua_tonumber(L, index));
+		break;
+	case LUA_TBOOLEAN:
+		lua_pushboolean(to, lua_toboolean(L, index));
+		break;
+	case LUA_TSTRING:
+		str = lua_tolstring(L, index, &len);
+		lua_pushlstring(to, str, len);
+		break;
+	default:
+		lua_pushnil(to);
+		break;
+	}
+}
+
+// Load and run the shard script (called in protected mode in the shard lua_State).
+// stack: script path, shard index, number of shards, args...
+static int prv_shard_init(lua_State * L) {
+	llwm_shard * shard = (llwm_shard *) lua_touserdata(L, 1);
+	lua_remove(L, 1); // stack: script, index, nbShards, args...
+	const char * script = luaL_checkstring(L, 1);
+
+	// Load script and call it with all other arguments.
+	if (luaL_loadfile(L, script) != 0)
+		return lua_error(L);
+	lua_replace(L, 1); // stack: scriptFunc, index, nbShards, args...
+	lua_call(L, lua_gettop(L) - 1, 1); // stack: fleet
+
+	// Script must return a fleet.
+	shard->fleet = (llwm_fleet *) luaL_checkudata(L, -1, "lualwm2m.fleet");
+	if (shard->fleet->epollfd < 0)
+		return luaL_error(L, "script '%s' returned a closed fleet", script);
+	shard->fleetRef = luaL_ref(L, LUA_REGISTRYINDEX); // stack:
+
+	lua_pushcfunction(L, prv_shard_poll);
+	shard->pollRef = luaL_ref(L, LUA_REGISTRYINDEX);
+	return 0;
+}
+
+static void prv_workers_stop(llwm_workers * workers) {
+	__atomic_store_n(&workers->running, 0, __ATOMIC_RELEASE);
+	int i;
+	for (i = 0; i < workers->started; i++)
+		pthread_join(workers->threads[i], NULL);
+	workers->started = 0;
+}
+
+static int workers_close(lua_State * L) {
+	llwm_workers * workers = (llwm_workers *) luaL_checkudata(L, 1,
+			"lualwm2m.workers");
+
+	// Stop threads.
+	prv_workers_stop(workers);
+	free(workers->threads);
+	workers->threads = NULL;
+
+	// Release shards (closing a lua_State closes its fleet and contexts).
+	int i;
+	if (workers->shards != NULL) {
+		for (i = 0; i < workers->nbShards; i++) {
+			llwm_shard * shard = &workers->shards[i];
+			if (shard->L != NULL)
+				lua_close(shard->L);
+			if (shard->timerfd >= 0)
+				close(shard->timerfd);
+			pthread_mutex_destroy(&shard->lock);
+			free(shard->error);
+		}
+		free(workers->shards);
+		workers->shards = NULL;
+	}
+	if (workers->epollfd >= 0) {
+		close(workers->epollfd);
+		workers->epollfd = -1;
+	}
+
+	return 0;
+}
+
+int llwm_workers_new(lua_State * L) {
+	// 1st parameter : script creating the fleet of a shard.
+	luaL_checkstring(L, 1);
+	// 2nd parameter : number of shards.
+	int nbShards = luaL_checkint(L, 2);
+	luaL_argcheck(L, nbShards > 0, 2, "should be a positive number");
+	// 3rd parameter : number of threads.
+	int nbThreads = luaL_optint(L, 3, nbShards);
+	luaL_argcheck(L, nbThreads > 0, 3, "should be a positive number");
+	// Other parameters are given to the script.
+	int nbArgs = lua_gettop(L) > 3 ? lua_gettop(L) - 3 : 0;
+
+	// Create workers userdata object and set its metatable.
+	llwm_workers * workers = lua_newuserdata(L, sizeof(llwm_workers));
+	memset(workers, 0, sizeof(llwm_workers));
+	workers->epollfd = -1;
+	workers->nbThreads = nbThreads;
+	luaL_getmetatable(L, "lualwm2m.workers");
+	lua_setmetatable(L, -2);
+	int workersIndex = lua_gettop(L);
+
+	workers->shards = calloc(nbShards, sizeof(llwm_shard));
+	workers->threads = calloc(nbThreads, sizeof(pthread_t));
+	workers->epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (workers->shards == NULL || workers->threads == NULL
+			|| workers->epollfd < 0)
+		return luaL_error(L, "unable to create workers : %s", strerror(errno));
+
+	// Create shards.
+	int i, j;
+	for (i = 0; i < nbShards; i++) {
+		llwm_shard * shard = &workers->shards[i];
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->timerfd = -1;
+		shard->fleetRef = LUA_NOREF;
+		shard->pollRef = LUA_NOREF;
+		workers->nbShards = i + 1;
+
+		shard->L = luaL_newstate();
+		if (shard->L == NULL)
+			return luaL_error(L, "unable to create lua state for shard %d", i + 1);
+		luaL_openlibs(shard->L);
+
+		// Run the script in the shard lua_State.
+		lua_pushcfunction(shard->L, prv_shard_init);
+		lua_pushlightuserdata(shard->L, shard);
+		prv_copy_value(L, 1, shard->L);
+		lua_pushinteger(shard->L, i + 1);
+		lua_pushinteger(shard->L, nbShards);
+		for (j = 0; j < nbArgs; j++)
+			prv_copy_value(L, 4 + j, shard->L);
+		// (on error, already created shards are released by __gc)
+		if (lua_pcall(shard->L, 4 + nbArgs, 0, 0) != 0)
+			return luaL_error(L, "unable to initialize shard %d : %s", i + 1,
+					lua_tostring(shard->L, -1));
+
+		// Wake up the shard when its next step is due.
+		shard->timerfd = timerfd_create(CLOCK_MONOTONIC,
+				TFD_NONBLOCK | TFD_CLOEXEC);
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (shard->timerfd < 0
+				|| epoll_ctl(shard->fleet->epollfd, EPOLL_CTL_ADD,
+						shard->timerfd, &ev) < 0)
+			return luaL_error(L, "unable to create timer for shard %d : %s",
+					i + 1, strerror(errno));
+		prv_shard_arm_timer(shard);
+	}
+
+	lua_pushvalue(L, workersIndex);
+	return 1;
+}
+
+static int workers_start(lua_State * L) {
+	// Get workers userdata.
+	llwm_workers * workers = checkworkers(L, "start");
+	if (workers->started > 0)
+		return luaL_error(L, "bad argument #1 to 'start' (already started)");
+
+	// Queue all shards.
+	int i;
+	for (i = 0; i < workers->nbShards; i++) {
+		llwm_shard * shard = &workers->shards[i];
+		if (shard->error == NULL)
+			prv_shard_rearm(workers, shard);
+	}
+
+	// Start threads.
+	__atomic_store_n(&workers->running, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < workers->nbThreads; i++) {
+		int err = pthread_create(&workers->threads[i], NULL, prv_worker_main,
+				workers);
+		if (err != 0) {
+			prv_workers_stop(workers);
+			lua_pushnil(L);
+			lua_pushstring(L, strerror(err));
+			return 2;
+		}
+		workers->started++;
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int workers_stop(lua_State * L) {
+	// Get workers userdata.
+	llwm_workers * workers = checkworkers(L, "stop");
+
+	// Wait for all threads (a shard being processed is completed first).
+	prv_workers_stop(workers);
+	return 0;
+}
+
+static int workers_stats(lua_State * L) {
+	// Get workers userdata.
+	llwm_workers * workers = checkworkers(L, "stats");
+
+	// Push a list of {clients, iterations, error} (one entry by shard).
+	lua_createtable(L, workers->nbShards, 0); // stack: workers, list
+	int i;
+	for (i = 0; i < workers->nbShards; i++) {
+		llwm_shard * shard = &workers->shards[i];
+		pthread_mutex_lock(&shard->lock);
+		lua_createtable(L, 0, 3); // stack: workers, list, entry
+		lua_pushinteger(L, shard->fleet->count);
+		lua_setfield(L, -2, "clients");
+		lua_pushnumber(L, shard->iterations);
+		lua_setfield(L, -2, "iterations");
+		if (shard->error != NULL) {
+			lua_pushstring(L, shard->error);
+			lua_setfield(L, -2, "error");
+		}
+		pthread_mutex_unlock(&shard->lock);
+		lua_rawseti(L, -2, i + 1); // stack: workers, list
+	}
+
+	return 1;
+}
+
+static const struct luaL_Reg workers_objmeths[] = { { "start", workers_start }, {
+		"stop", workers_stop }, { "stats", workers_stats }, { "close",
+		workers_close }, { "__gc", workers_close }, { NULL, NULL } };
+
+void llwm_workers_register(lua_State * L) {
+	// Define workers object metatable.
+	luaL_newmetatable(L, "lualwm2m.workers"); // stack: metatable
+
+	// Do : metatable.__index = metatable.
+	lua_pushvalue(L, -1); // stack: metatable, metatable
+	lua_setfield(L, -2, "__index"); // stack: metatable
+
+	// Register workers object methods : set methods to table on top of the stack
+	luaL_register(L, NULL, workers_objmeths); // stack: metatable
+	lua_pop(L, 1); // stack:
+}
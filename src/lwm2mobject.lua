@@ -19,6 +19,19 @@ M.LWM2M_STRING = 0x01
 M.LWM2M_NUMBER = 0x02
 M.LWM2M_BOOLEAN = 0x03
 
+-- Size of chunks of stream resources
+M.CHUNK_SIZE = 1024
+
+-- write a stream resource chunk by chunk : op.write(instance, chunk, offset, last)
+local function writestream (instance, op, value)
+  local offset = 0
+  repeat
+    local chunk = value:sub(offset + 1, offset + M.CHUNK_SIZE)
+    offset = offset + #chunk
+    op.write(instance, chunk, offset - #chunk, offset >= #value)
+  until offset >= #value
+end
+
 -- LWM2M Read operation
 local function read (instance, resourceid)
   local _mt = getmetatable(instance)
@@ -63,7 +76,9 @@ local function write (instance, resourceid, value)
   elseif optype == "function" then
     return M.CHANGED, op(instance, "write", value)
   elseif optype == "table" then
-    if type(op.write) == "function" then
+    if type(op.write) == "function" and op.stream then
+      return M.CHANGED, writestream(instance, op, value)
+    elseif type(op.write) == "function" then
       return M.CHANGED, op.write(instance,value)
     elseif type(op.write) == "boolean" and op.write then
       instance[resourceid]  = value
@@ -144,13 +159,20 @@ local function _type (instance, resourceid)
   return M.LWM2M_STRING
 end
 
+-- remove an instance from its object
+local function remove (obj, id)
+  rawset(obj, id, nil)
+  -- instances of a range must not be created again at next access
+  if obj.deleted then obj.deleted[id] = true end
+end
+
 -- LWM2M delete operation
 local function delete (instance)
   local _mt = getmetatable(instance)
   local obj = _mt.object
 
   if type(instance.delete) == "boolean" and instance.delete then
-    obj[instance.id]  = nil
+    remove(obj, instance.id)
     return M.DELETED
   end
 
@@ -158,7 +180,7 @@ local function delete (instance)
   -- default behavior is to :
   -- delete is llowed for multiinstance and forbidden for single one.
   if obj.multi then
-    obj[instance.id] = nil
+    remove(obj, instance.id)
     return M.DELETED
   else
     return M.METHOD_NOT_ALLOWED
@@ -185,9 +207,13 @@ function M.new(id, operations, multi)
   local object = {
     id = id,
     operations = operations,
+    -- set it to true before the object is registered to compile its
+    -- operations in C (later changes of operations are then ignored
+    -- until ll:redefine(id) is called).
+    native = false,
     newinstance = function (obj,id)
       local instance = {id = id}
-      obj[id] = instance
+      rawset(obj, id, instance)
       setmetatable(instance,{
         object     = obj,
         __index    = {read = read, write = write, execute = execute, list = list, delete = delete, type = _type},
@@ -196,12 +222,30 @@ function M.new(id, operations, multi)
     end,
     multi = multi,
     create = function (obj,id)
-      if multi and not obj[id] then
+      if multi and not rawget(obj, id) then
+        if obj.deleted then obj.deleted[id] = nil end
         local instance = obj:newinstance(id)
         return M.CREATED, instance
       else
         return M.METHOD_NOT_ALLOWED
       end
+    end,
+    -- declare instances from first to last without creating them,
+    -- each one is created (and given to init) at its first access.
+    instancerange = function (obj, first, last, init)
+      obj.range = {first, last}
+      obj.deleted = {}
+      setmetatable(obj, {
+        __index = function (o, id)
+          if type(id) == "number" and id >= first and id <= last
+            and not o.deleted[id] then
+            local instance = o:newinstance(id)
+            if init then init(instance) end
+            return instance
+          end
+        end
+      })
+      return obj
     end
   }
 